@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "friends.h"
+#include "bench_util.h"
+
+#define DEFAULT_NUM_USERS 10000
+#define DEFAULT_NUM_FRIENDS 10
+#define DEFAULT_NUM_POSTS 10
+#define DEFAULT_NUM_RUNS 5
+#define DEFAULT_NUM_WARMUPS 1
+#define MAX_RUNS 100
+#define NUM_LISTINGS 100        // list_users calls per run
+#define NUM_PROFILES 1000       // Most profiles rendered per run
+#define FEED_POSTS 10           // Posts in each feed rendered
+#define PAGE_POSTS 10           // Posts on each page of a profile rendered
+#define SUGGESTIONS 10          // Users in each list of suggested friends
+#define POST_CONTENTS "a post from the api benchmark"
+
+// This program is linked with --wrap=malloc,--wrap=calloc,--wrap=realloc so every allocation
+// made by friends.o and slab.o goes through the counting wrappers below.
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t num, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static long num_allocs = 0;
+
+void *__wrap_malloc(size_t size) {
+    num_allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t num, size_t size) {
+    num_allocs++;
+    return __real_calloc(num, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    num_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+// The size of the synthetic graphs and how often each benchmark is run.
+static int num_users = DEFAULT_NUM_USERS;
+static int num_friends = DEFAULT_NUM_FRIENDS;
+static int num_posts = DEFAULT_NUM_POSTS;
+static int num_runs = DEFAULT_NUM_RUNS;
+static int num_warmups = DEFAULT_NUM_WARMUPS;
+static char (*names)[MAX_NAME];
+
+// One timed run of a benchmark: how long its operations took and how many allocations they made.
+typedef struct run {
+    long long ns;
+    long allocs;
+} Run;
+
+// What the benchmarks work on: the graph built last and the buffers the reads fill.
+typedef struct bench_state {
+    User *user_list;
+    User **users;           // The users of user_list, in order
+    int *lookups;           // The user numbers find_user looks up
+    User *volatile found;   // Keeps the lookups from being optimized away
+    StrBuf buf;
+    MutualCounts mutual;
+} BenchState;
+
+
+/*
+ * Start timing a run of a benchmark.
+ */
+void start_run(Run *run) {
+    run->allocs = num_allocs;
+    run->ns = now_ns();
+}
+
+
+/*
+ * Stop timing the run started with start_run.
+ */
+void end_run(Run *run) {
+    run->ns = now_ns() - run->ns;
+    run->allocs = num_allocs - run->allocs;
+}
+
+
+/*
+ * Compare two runs by time, for qsort.
+ */
+int compare_runs(const void *a, const void *b) {
+    long long diff = ((const Run *)a)->ns - ((const Run *)b)->ns;
+    return (diff > 0) - (diff < 0);
+}
+
+
+/*
+ * Print one CSV line for the benchmark <name>, whose <runs> each made <ops> operations: the best
+ * and median time per operation and the allocations per operation of the median run.
+ */
+void report(const char *name, Run *runs, long ops) {
+    qsort(runs, num_runs, sizeof(Run), compare_runs);
+    const Run *median = &runs[num_runs / 2];
+    printf("%s,%d,%d,%d,%ld,%d,%.1f,%.1f,%.3f\n", name, num_users, num_friends, num_posts, ops, num_runs,
+           (double)runs[0].ns / ops, (double)median->ns / ops, (double)median->allocs / ops);
+    fflush(stdout);
+}
+
+
+/*
+ * Run the benchmark <name> num_warmups times untimed and then num_runs times, and report it.
+ * Each run first calls <setup> on <arg>, untimed, if it is not NULL, and then times calling
+ * <op> on <arg> once for every operation number from 0 to <ops> - 1.
+ */
+void run_bench(const char *name, void (*setup)(void *), void (*op)(void *, long), void *arg, long ops) {
+    Run runs[MAX_RUNS];
+    for (int i = -num_warmups; i < num_runs; i++) {
+        if (setup != NULL) {
+            setup(arg);
+        }
+        Run run;
+        start_run(&run);
+        for (long j = 0; j < ops; j++) {
+            op(arg, j);
+        }
+        end_run(&run);
+        if (i >= 0) {
+            runs[i] = run;
+        }
+    }
+    report(name, runs, ops);
+}
+
+
+/*
+ * Return a new list of all the users, not yet friends with anyone.
+ */
+User *build_users() {
+    User *user_list = NULL;
+    for (int i = 0; i < num_users; i++) {
+        create_user(names[i], &user_list);
+    }
+    return user_list;
+}
+
+
+/*
+ * Make every user friends with the num_friends / 2 users after it, wrapping around at the end of
+ * the list, so every user has num_friends friends (rounded down to an even number).
+ */
+void befriend_neighbours(User *user_list) {
+    for (int i = 0; i < num_users; i++) {
+        for (int j = 1; j <= num_friends / 2; j++) {
+            make_friends(names[i], names[(i + j) % num_users], user_list);
+        }
+    }
+}
+
+
+/*
+ * Start a run with no users. Users, friendships and posts are never freed, so each run of the
+ * benchmarks that add them starts from a new graph.
+ */
+void start_empty(void *arg) {
+    ((BenchState *)arg)->user_list = NULL;
+}
+
+
+/*
+ * Create user <i>.
+ */
+void op_create_user(void *arg, long i) {
+    create_user(names[i], &((BenchState *)arg)->user_list);
+}
+
+
+/*
+ * Start a run with all the users, not yet friends with anyone.
+ */
+void start_users(void *arg) {
+    ((BenchState *)arg)->user_list = build_users();
+}
+
+
+/*
+ * Make user <i> / (num_friends / 2) friends with one of the num_friends / 2 users after it, so
+ * the run leaves the users as befriend_neighbours does.
+ */
+void op_make_friends(void *arg, long i) {
+    int user = i / (num_friends / 2);
+    int offset = i % (num_friends / 2) + 1;
+    make_friends(names[user], names[(user + offset) % num_users], ((BenchState *)arg)->user_list);
+}
+
+
+/*
+ * Start a run with all the users, each friends with its neighbours and without posts.
+ */
+void start_friends(void *arg) {
+    BenchState *state = arg;
+    state->user_list = build_users();
+    befriend_neighbours(state->user_list);
+    int j = 0;
+    for (User *curr = state->user_list; curr != NULL; curr = curr->next) {
+        state->users[j++] = curr;
+    }
+}
+
+
+/*
+ * Give user <i> % num_users a post from the next user, which is one of its friends, so a run of
+ * num_users * num_posts operations gives every user num_posts posts.
+ */
+void op_make_post(void *arg, long i) {
+    User **users = ((BenchState *)arg)->users;
+    make_post_copy(users[(i + 1) % num_users], users[i % num_users], POST_CONTENTS, strlen(POST_CONTENTS));
+}
+
+
+/*
+ * Find the <i>th user looked up. This and the rest only read the last graph built.
+ */
+void op_find_user(void *arg, long i) {
+    BenchState *state = arg;
+    state->found = find_user(names[state->lookups[i]], state->user_list);
+}
+
+
+/*
+ * List the users.
+ */
+void op_list_users(void *arg, long i) {
+    free(list_users(((BenchState *)arg)->user_list));
+}
+
+
+/*
+ * Start a run with a new buffer to render into, so its allocations count the buffer growing.
+ */
+void start_buf(void *arg) {
+    BenchState *state = arg;
+    free(state->buf.data);
+    state->buf = (StrBuf){NULL, 0, 0};
+}
+
+
+/*
+ * Render the profile of user <i>.
+ */
+void op_render_user(void *arg, long i) {
+    BenchState *state = arg;
+    state->buf.len = 0;
+    render_user(state->users[i], &state->buf);
+}
+
+
+/*
+ * Render the page halfway down the wall of user <i>, found through the post index.
+ */
+void op_render_profile_page(void *arg, long i) {
+    BenchState *state = arg;
+    state->buf.len = 0;
+    render_profile_page(state->users[i], num_posts / 2, PAGE_POSTS, &state->buf);
+}
+
+
+/*
+ * Render the feed of user <i>.
+ */
+void op_render_feed(void *arg, long i) {
+    BenchState *state = arg;
+    state->buf.len = 0;
+    render_feed(state->users[i], FEED_POSTS, &state->buf);
+}
+
+
+/*
+ * Count the mutual friends of user <i> and render its suggested friends.
+ */
+void op_suggest(void *arg, long i) {
+    BenchState *state = arg;
+    const FriendSet *friends = &state->users[i]->friends;
+    for (unsigned int k = 0; k < friends->count; k++) {
+        count_mutual_friends(&state->mutual, friends->members[k]);
+    }
+    state->buf.len = 0;
+    render_suggestions(&state->mutual, state->users[i], friends->members, friends->count, SUGGESTIONS, &state->buf);
+}
+
+
+/*
+ * Start a run with the profiles cached, so the timed runs only copy them.
+ */
+void start_cached(void *arg) {
+    User **users = ((BenchState *)arg)->users;
+    for (int j = 0; j < num_users && j < NUM_PROFILES; j++) {
+        free(print_user(users[j]));
+    }
+}
+
+
+/*
+ * Copy the cached profile of user <i>.
+ */
+void op_print_user(void *arg, long i) {
+    free(print_user(((BenchState *)arg)->users[i]));
+}
+
+
+/*
+ * Time the operations of the friends.c API in isolation on synthetic graphs of num_users users,
+ * each with num_friends friends and num_posts posts. Every benchmark is run num_warmups times
+ * untimed and then num_runs times; one CSV line reports the best and median ns/op and the
+ * allocations/op of each.
+ * Usage: bench_api [-n users] [-f friends] [-p posts] [-r runs] [-w warmups]
+ */
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:f:p:r:w:")) != -1) {
+        switch (opt) {
+            case 'n':
+                num_users = strtol(optarg, NULL, 10);
+                break;
+            case 'f':
+                num_friends = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                num_posts = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                num_runs = strtol(optarg, NULL, 10);
+                break;
+            case 'w':
+                num_warmups = strtol(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n users] [-f friends] [-p posts] [-r runs] [-w warmups]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (num_users < 2 || num_friends < 2 || num_friends >= num_users || num_posts < 1
+        || num_runs < 1 || num_runs > MAX_RUNS || num_warmups < 0) {
+        fprintf(stderr, "%s: needs at least 2 users, 2 to users - 1 friends, 1 post and 1 to %d runs\n",
+                argv[0], MAX_RUNS);
+        exit(1);
+    }
+
+    names = malloc(num_users * sizeof(*names));
+    BenchState state = {NULL, NULL, NULL, NULL, {NULL, 0, 0}, {NULL, 0, NULL, 0, 0}};
+    state.users = malloc(num_users * sizeof(User *));
+    state.lookups = malloc(num_users * sizeof(int));
+    if (names == NULL || state.users == NULL || state.lookups == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    unsigned int seed = 1;
+    for (int i = 0; i < num_users; i++) {
+        snprintf(names[i], MAX_NAME, "user%d", i);
+        state.lookups[i] = rand_r(&seed) % num_users;
+    }
+    int num_profiles = num_users < NUM_PROFILES ? num_users : NUM_PROFILES;
+
+    printf("benchmark,users,friends,posts,ops,runs,ns_per_op_best,ns_per_op_median,allocs_per_op\n");
+    run_bench("create_user", start_empty, op_create_user, &state, num_users);
+    run_bench("make_friends", start_users, op_make_friends, &state, (long)num_users * (num_friends / 2));
+    run_bench("make_post", start_friends, op_make_post, &state, (long)num_users * num_posts);
+    run_bench("find_user", NULL, op_find_user, &state, num_users);
+    run_bench("list_users", NULL, op_list_users, &state, NUM_LISTINGS);
+    run_bench("render_user", start_buf, op_render_user, &state, num_profiles);
+    run_bench("render_profile_page", start_buf, op_render_profile_page, &state, num_profiles);
+    run_bench("render_feed", start_buf, op_render_feed, &state, num_profiles);
+    run_bench("suggest", start_buf, op_suggest, &state, num_profiles);
+    run_bench("print_user", start_cached, op_print_user, &state, num_profiles);
+
+    free(state.buf.data);
+    free(state.mutual.counts);
+    free(state.mutual.candidates);
+    free(state.lookups);
+    free(state.users);
+    free(names);
+    return 0;
+}
@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "friends.h"
+#include "bench_util.h"
+
+#define DEFAULT_NUM_CONNECTIONS 1000
+#define DEFAULT_DURATION 10
+#define DEFAULT_MIX "1:1:5:3"   // Weights of list_users, make_friends, post and profile
+#define MAX_EVENTS 256
+#define LINE_SIZE 256           // Only the start of a long line is kept; it is only compared to known replies
+#define SENTINEL "?\r\n"        // Sent after a post, which has no reply; the server's reply marks its end
+#define SENTINEL_REPLY "Incorrect syntax"
+#define PROFILE_SEPARATOR "------------------------------------------"
+#define PROFILE_SEPARATORS 3    // A profile ends with the third separator line
+#define FRIENDS_REPLY "You are now friends with "
+#define SUB_BUCKETS 16          // Latency histogram buckets per power of two microseconds
+#define NUM_BUCKETS (40 * SUB_BUCKETS)
+
+// The commands the load generator sends, in the order their weights are given.
+typedef enum {
+    OP_LIST_USERS,
+    OP_MAKE_FRIENDS,
+    OP_POST,
+    OP_PROFILE,
+    NUM_OPS
+} Op;
+
+static const char *op_names[NUM_OPS] = {"list_users", "make_friends", "post", "profile"};
+
+// The replies to a make_friends that failed.
+static const char *friend_errors[] = {
+    "users are already friends",
+    "at least one user you entered has the max number of friends",
+    "you must enter two different users",
+    "at least one user you entered does not exist",
+    NULL
+};
+
+// A latency histogram with SUB_BUCKETS linear buckets for every power of two microseconds, so
+// each bucket is within 1/SUB_BUCKETS of the latencies it holds.
+typedef struct histogram {
+    unsigned long counts[NUM_BUCKETS];
+    unsigned long total;
+    long long max_ns;
+} Histogram;
+
+// One connection to the server, logged in as user number <id>. It has at most one command in flight.
+typedef struct connection {
+    int fd;
+    int id;
+    Op op;                  // The command in flight
+    int target;             // The user number it names
+    int lines_seen;         // Separators of a profile or users of a listing received for it so far
+    int befriended;         // Set once a make_friends of this connection has succeeded
+    long long sent_ns;      // When it was sent
+    char line[LINE_SIZE];   // The start of the line being received
+    size_t line_len;
+} Connection;
+
+static int num_connections = DEFAULT_NUM_CONNECTIONS;
+static int num_listed = 0;      // Users in the reply to list_users, found before the mix is run
+static unsigned int seed = 1;
+static char user_prefix[MAX_NAME / 2];
+
+
+/*
+ * Return the histogram bucket of a latency of <ns> nanoseconds.
+ */
+int bucket_of(long long ns) {
+    long long us = ns / 1000;
+    if (us < SUB_BUCKETS) {
+        return us;
+    }
+    // The power of two below us picks the group; the next bits pick the bucket within it.
+    int power = 63 - __builtin_clzll(us);
+    int sub = (us >> (power - 4)) & (SUB_BUCKETS - 1);
+    int bucket = (power - 3) * SUB_BUCKETS + sub;
+    return bucket < NUM_BUCKETS ? bucket : NUM_BUCKETS - 1;
+}
+
+
+/*
+ * Return the smallest latency in microseconds that falls in <bucket>.
+ */
+double bucket_floor_us(int bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    int power = bucket / SUB_BUCKETS + 3;
+    int sub = bucket % SUB_BUCKETS;
+    return (double)(1LL << power) + sub * (double)(1LL << (power - 4));
+}
+
+
+/*
+ * Add a latency of <ns> nanoseconds to <hist>.
+ */
+void record(Histogram *hist, long long ns) {
+    hist->counts[bucket_of(ns)]++;
+    hist->total++;
+    if (ns > hist->max_ns) {
+        hist->max_ns = ns;
+    }
+}
+
+
+/*
+ * Return the latency in microseconds below which the fraction <quantile> of the latencies in <hist> fall.
+ */
+double percentile_us(const Histogram *hist, double quantile) {
+    unsigned long rank = (unsigned long)(quantile * hist->total);
+    unsigned long seen = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen > rank) {
+            return bucket_floor_us(i + 1);
+        }
+    }
+    return hist->max_ns / 1000.0;
+}
+
+
+/*
+ * Return a random user number other than <id>.
+ */
+int other_user(int id) {
+    int other = rand_r(&seed) % (num_connections - 1);
+    return other >= id ? other + 1 : other;
+}
+
+
+/*
+ * Send the next command of <conn>, picked at random with the weights <mix>, and a sentinel after a post.
+ * Posts go to the next user, whom every user befriends when it logs in, so they succeed.
+ */
+void send_command(Connection *conn, const int *mix, int mix_total) {
+    int pick = rand_r(&seed) % mix_total;
+    Op op = 0;
+    while (pick >= mix[op]) {
+        pick -= mix[op];
+        op++;
+    }
+
+    char command[2 * MAX_NAME + 64];
+    int len = 0;
+    int target = other_user(conn->id);
+    if (op == OP_POST) {
+        target = (conn->id + 1) % num_connections;
+    } else if (op == OP_MAKE_FRIENDS) {
+        // One of the users just after this one, so two users never befriend each other at the
+        // same time: the notification of the other's success would look like this one's reply.
+        target = (conn->id + 1 + rand_r(&seed) % ((num_connections - 1) / 2)) % num_connections;
+    }
+    switch (op) {
+        case OP_LIST_USERS:
+            len = snprintf(command, sizeof(command), "list_users\r\n");
+            break;
+        case OP_MAKE_FRIENDS:
+            len = snprintf(command, sizeof(command), "make_friends %s%d\r\n", user_prefix, target);
+            break;
+        case OP_POST:
+            len = snprintf(command, sizeof(command), "post %s%d load test post %d\r\n" SENTINEL,
+                           user_prefix, target, rand_r(&seed));
+            break;
+        case OP_PROFILE:
+            len = snprintf(command, sizeof(command), "profile %s%d\r\n", user_prefix, target);
+            break;
+        default:
+            break;
+    }
+    conn->op = op;
+    conn->target = target;
+    conn->lines_seen = 0;
+    conn->sent_ns = now_ns();
+    write_all(conn->fd, command, len);
+}
+
+
+/*
+ * Return 1 if <line>, of <len> bytes without its network newline, ends the response to the
+ * command in flight on <conn>, and 0 if more of it is to come or the line is a notification
+ * from another connection's command. Notifications are whole lines sent between responses.
+ */
+int ends_response(Connection *conn, const char *line, size_t len) {
+    int is_sentinel = len == strlen(SENTINEL_REPLY) && memcmp(line, SENTINEL_REPLY, len) == 0;
+    switch (conn->op) {
+        case OP_LIST_USERS:
+            // Every listed user is on its own line starting with a tab. Until the number of
+            // users is known, the listing is followed by the sentinel to count them.
+            if (len > 0 && line[0] == '\t') {
+                return ++conn->lines_seen == num_listed;
+            }
+            if (num_listed == 0 && is_sentinel) {
+                num_listed = conn->lines_seen;
+                return 1;
+            }
+            return 0;
+        case OP_MAKE_FRIENDS: {
+            // The reply either names the new friend or is one of the errors; anything else is a notification.
+            char reply[LINE_SIZE];
+            int reply_len = snprintf(reply, sizeof(reply), FRIENDS_REPLY "%s%d!", user_prefix, conn->target);
+            if (len == (size_t)reply_len && memcmp(line, reply, len) == 0) {
+                conn->befriended = 1;
+                return 1;
+            }
+            for (int i = 0; friend_errors[i] != NULL; i++) {
+                if (len == strlen(friend_errors[i]) && memcmp(line, friend_errors[i], len) == 0) {
+                    return 1;
+                }
+            }
+            return 0;
+        }
+        case OP_POST:
+            return is_sentinel;
+        case OP_PROFILE:
+            if (len == strlen(PROFILE_SEPARATOR) && memcmp(line, PROFILE_SEPARATOR, len) == 0) {
+                return ++conn->lines_seen == PROFILE_SEPARATORS;
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+
+/*
+ * Read what has arrived on <conn> and return the number of responses it completes. Lines are
+ * split on network newlines and framed by ends_response.
+ */
+int read_replies(Connection *conn) {
+    char buf[65536];
+    ssize_t num_read = read(conn->fd, buf, sizeof(buf));
+    if (num_read <= 0) {
+        fprintf(stderr, "server closed connection %d\n", conn->id);
+        exit(1);
+    }
+
+    int num_responses = 0;
+    for (ssize_t i = 0; i < num_read; i++) {
+        if (buf[i] == '\n') {
+            // Compare the line without its carriage return.
+            size_t len = conn->line_len > 0 && conn->line[conn->line_len - 1] == '\r' ? conn->line_len - 1 : conn->line_len;
+            num_responses += ends_response(conn, conn->line, len);
+            conn->line_len = 0;
+        } else if (conn->line_len < LINE_SIZE) {
+            conn->line[conn->line_len++] = buf[i];
+        }
+    }
+    return num_responses;
+}
+
+
+/*
+ * Parse the weights of list_users, make_friends, post and profile from <spec>, like "1:1:5:3",
+ * into <mix>. Return their total, or -1 if <spec> is not four non-negative weights.
+ */
+int parse_mix(const char *spec, int *mix) {
+    int total = 0;
+    for (int i = 0; i < NUM_OPS; i++) {
+        char *end;
+        long weight = strtol(spec, &end, 10);
+        if (end == spec || weight < 0 || (i < NUM_OPS - 1 ? *end != ':' : *end != '\0')) {
+            return -1;
+        }
+        mix[i] = weight;
+        total += weight;
+        spec = end + 1;
+    }
+    return total > 0 ? total : -1;
+}
+
+
+/*
+ * Print the latency percentiles of <hist> on one line labelled <label>.
+ */
+void print_latency(const char *label, const Histogram *hist, double seconds) {
+    if (hist->total == 0) {
+        printf("%-13s %10d ops\n", label, 0);
+        return;
+    }
+    printf("%-13s %10lu ops %10.0f ops/sec   p50 %8.1f us   p99 %8.1f us   p999 %8.1f us   max %8.1f us\n",
+           label, hist->total, hist->total / seconds, percentile_us(hist, 0.5), percentile_us(hist, 0.99),
+           percentile_us(hist, 0.999), hist->max_ns / 1000.0);
+}
+
+
+/*
+ * Print the non-empty buckets of <hist>, one per power of two microseconds.
+ */
+void print_histogram(const Histogram *hist) {
+    printf("latency histogram (all commands):\n");
+    for (int group = 0; group < NUM_BUCKETS / SUB_BUCKETS; group++) {
+        unsigned long count = 0;
+        for (int i = group * SUB_BUCKETS; i < (group + 1) * SUB_BUCKETS; i++) {
+            count += hist->counts[i];
+        }
+        if (count > 0) {
+            double low = bucket_floor_us(group * SUB_BUCKETS);
+            double high = bucket_floor_us((group + 1) * SUB_BUCKETS);
+            printf("  %9.0f - %9.0f us %10lu %6.2f%%\n", low, high, count, 100.0 * count / hist->total);
+        }
+    }
+}
+
+
+/*
+ * Load test a running friend_server: open many connections, log each in as its own user and
+ * have each send commands picked at random from a weighted mix, one at a time, for a while.
+ * Report the throughput and latency percentiles of each command and overall.
+ * Usage: bench_load [-c connections] [-d seconds] [-m list_users:make_friends:post:profile] [-s seed]
+ */
+int main(int argc, char **argv) {
+    int duration = DEFAULT_DURATION;
+    const char *mix_spec = DEFAULT_MIX;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:m:s:")) != -1) {
+        switch (opt) {
+            case 'c':
+                num_connections = strtol(optarg, NULL, 10);
+                break;
+            case 'd':
+                duration = strtol(optarg, NULL, 10);
+                break;
+            case 'm':
+                mix_spec = optarg;
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c connections] [-d seconds] [-m list_users:make_friends:post:profile weights]"
+                        " [-s seed]\n", argv[0]);
+                exit(1);
+        }
+    }
+    int mix[NUM_OPS];
+    int mix_total = parse_mix(mix_spec, mix);
+    if (mix_total == -1 || num_connections < 3 || duration < 1) {
+        fprintf(stderr, "%s: needs at least 3 connections, 1 second and a mix of 4 weights like %s\n", argv[0], DEFAULT_MIX);
+        exit(1);
+    }
+
+    // Every connection needs a descriptor.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)num_connections + 16) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // Unique names so the benchmark can be run again against the same server.
+    snprintf(user_prefix, sizeof(user_prefix), "ld%d_", getpid() % 100000);
+
+    Connection *conns = calloc(num_connections, sizeof(Connection));
+    if (conns == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    // Log every connection in, then have each befriend the next user so posts to it succeed.
+    long long start = now_ns();
+    for (int i = 0; i < num_connections; i++) {
+        char name[MAX_NAME];
+        snprintf(name, sizeof(name), "%s%d", user_prefix, i);
+        conns[i].fd = connect_as(name);
+        conns[i].id = i;
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &conns[i];
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conns[i].fd, &event) == -1) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < num_connections; i++) {
+        char command[MAX_NAME + 32];
+        conns[i].op = OP_MAKE_FRIENDS;
+        conns[i].target = (i + 1) % num_connections;
+        int len = snprintf(command, sizeof(command), "make_friends %s%d\r\n", user_prefix, conns[i].target);
+        write_all(conns[i].fd, command, len);
+    }
+    // A connection is ready once the friendship is confirmed; the mix must not start before the graph exists.
+    struct epoll_event events[MAX_EVENTS];
+    int num_ready = 0;
+    while (num_ready < num_connections) {
+        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < num_events; i++) {
+            Connection *conn = events[i].data.ptr;
+            int was_befriended = conn->befriended;
+            if (read_replies(conn) > 0 && !conn->befriended) {
+                fprintf(stderr, "connection %d could not befriend the next user\n", conn->id);
+                exit(1);
+            }
+            num_ready += conn->befriended && !was_befriended;
+        }
+    }
+    // Count the users once every connection has logged in, so list_users can be framed by its length.
+    conns[0].op = OP_LIST_USERS;
+    conns[0].lines_seen = 0;
+    write_all(conns[0].fd, "list_users\r\n" SENTINEL, strlen("list_users\r\n" SENTINEL));
+    while (read_replies(&conns[0]) == 0) {
+    }
+    printf("%d connections logged in and befriended in %.3f s\n", num_connections, (now_ns() - start) / 1e9);
+
+    // Run the mix.
+    Histogram *hists = calloc(NUM_OPS + 1, sizeof(Histogram));
+    if (hists == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    Histogram *all = &hists[NUM_OPS];
+    for (int i = 0; i < num_connections; i++) {
+        send_command(&conns[i], mix, mix_total);
+    }
+    start = now_ns();
+    long long end = start + duration * 1000000000LL;
+    long long now;
+    while ((now = now_ns()) < end) {
+        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, 100);
+        if (num_events == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < num_events; i++) {
+            Connection *conn = events[i].data.ptr;
+            if (read_replies(conn) > 0) {
+                long long latency = now_ns() - conn->sent_ns;
+                record(&hists[conn->op], latency);
+                record(all, latency);
+                send_command(conn, mix, mix_total);
+            }
+        }
+    }
+    double seconds = (now - start) / 1e9;
+
+    printf("mix %s over %d connections for %.1f s\n", mix_spec, num_connections, seconds);
+    for (int op = 0; op < NUM_OPS; op++) {
+        print_latency(op_names[op], &hists[op], seconds);
+    }
+    print_latency("all", all, seconds);
+    print_histogram(all);
+
+    for (int i = 0; i < num_connections; i++) {
+        close(conns[i].fd);
+    }
+    free(hists);
+    free(conns);
+    return 0;
+}
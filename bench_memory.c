@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "friends.h"
+
+#define DEFAULT_NUM_USERS 1000
+#define DEFAULT_NUM_POSTS 1000000
+
+
+/*
+ * Return the number of bytes of heap memory currently in use, as reported by malloc
+ * (this includes the slabs the post and user pools carve objects out of).
+ */
+size_t heap_in_use() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+
+/*
+ * Report the heap memory used per user and per post when <num_posts> short posts are
+ * spread across <num_users> users.
+ * Usage: bench_memory [num_users] [num_posts]
+ */
+int main(int argc, char **argv) {
+    int num_users = argc > 1 ? strtol(argv[1], NULL, 10) : DEFAULT_NUM_USERS;
+    long num_posts = argc > 2 ? strtol(argv[2], NULL, 10) : DEFAULT_NUM_POSTS;
+    if (num_users < 2) {
+        fprintf(stderr, "bench_memory needs at least 2 users\n");
+        exit(1);
+    }
+
+    size_t start = heap_in_use();
+    User *user_list = NULL;
+    char name[MAX_NAME];
+    for (int i = 0; i < num_users; i++) {
+        snprintf(name, MAX_NAME, "user%d", i);
+        create_user(name, &user_list);
+    }
+    size_t after_users = heap_in_use();
+
+    // The users form a ring of friends and every user posts to the wall of the user before it.
+    User *prev = user_list;
+    for (User *curr = user_list->next; curr != NULL; curr = curr->next) {
+        make_friends(prev->name, curr->name, user_list);
+        prev = curr;
+    }
+    make_friends(prev->name, user_list->name, user_list);
+    size_t after_friends = heap_in_use();
+
+    User *author = user_list->next;
+    User *target = user_list;
+    for (long i = 0; i < num_posts; i++) {
+        char *contents = malloc(32);
+        if (contents == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        snprintf(contents, 32, "post %ld", i);
+        make_post(author, target, contents);
+
+        target = author;
+        author = author->next != NULL ? author->next : user_list;
+    }
+    size_t after_posts = heap_in_use();
+
+    printf("users: %d, %.1f bytes/user\n", num_users, (double)(after_users - start) / num_users);
+    printf("posts: %ld, %.1f bytes/post\n", num_posts,
+           num_posts > 0 ? (double)(after_posts - after_friends) / num_posts : 0.0);
+    return 0;
+}
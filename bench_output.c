@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "friends.h"
+#include "client.h"
+#include "bench_util.h"
+
+#define DEFAULT_NUM_POSTS 50
+#define NUM_ROUNDS 2000
+
+// This program is linked with --wrap=write,--wrap=send,--wrap=writev so every call to those
+// functions (from this file or from client.o) goes through the counting wrappers below.
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_send(int fd, const void *buf, size_t len, int flags);
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+
+static long num_syscalls = 0;
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+    num_syscalls++;
+    return __real_write(fd, buf, count);
+}
+
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags) {
+    num_syscalls++;
+    return __real_send(fd, buf, len, flags);
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt) {
+    num_syscalls++;
+    return __real_writev(fd, iov, iovcnt);
+}
+
+
+/*
+ * The way friend_server used to send a message: split it into lines and write each line,
+ * with its network newline, using its own write call.
+ * Return 0 on success or -1 if the write failed.
+ */
+int message_client_per_line(int fd, const char *message) {
+    const char *line = message;
+    const char *newline;
+    while ((newline = strchr(line, '\n')) != NULL) {
+        char buf[newline - line + 2];
+        memcpy(buf, line, newline - line);
+        buf[newline - line] = '\r';
+        buf[newline - line + 1] = '\n';
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+            return -1;
+        }
+        line = newline + 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Count the system calls used to send the profile of a user with <num_posts> posts, first
+ * the old line-by-line way and then through a client's output queue.
+ * Usage: bench_output [num_posts]
+ */
+int main(int argc, char **argv) {
+    int num_posts = argc > 1 ? strtol(argv[1], NULL, 10) : DEFAULT_NUM_POSTS;
+
+    User *user_list = NULL;
+    create_user("author", &user_list);
+    create_user("reader", &user_list);
+    make_friends("author", "reader", user_list);
+    User *author = find_user("author", user_list);
+    User *reader = find_user("reader", user_list);
+    for (int i = 0; i < num_posts; i++) {
+        char *contents = malloc(64);
+        if (contents == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        snprintf(contents, 64, "post number %d from the benchmark", i);
+        make_post(author, reader, contents);
+    }
+    char *profile = print_user(reader);
+    int lines = 0;
+    for (char *c = profile; *c != '\0'; c++) {
+        lines += *c == '\n';
+    }
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+    int size = 1 << 20;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    printf("profile: %d posts, %zu bytes, %d lines\n", num_posts, strlen(profile), lines);
+
+    // Before: one write per line.
+    num_syscalls = 0;
+    long long start = now_ns();
+    for (int i = 0; i < NUM_ROUNDS; i++) {
+        if (message_client_per_line(fds[0], profile) == -1) {
+            perror("write");
+            exit(1);
+        }
+        drain(fds[1]);
+    }
+    long long elapsed = now_ns() - start;
+    printf("per-line write: %.1f syscalls/response, %.0f ns/response\n",
+           (double)num_syscalls / NUM_ROUNDS, (double)elapsed / NUM_ROUNDS);
+
+    // After: translated into the output queue and sent together.
+    ClientTable clients = {NULL, 0, NULL, NULL, NULL, 0, NULL, NULL, -1, NULL, NULL};
+    Client *client = add_client(&clients, fds[0]);
+    num_syscalls = 0;
+    start = now_ns();
+    for (int i = 0; i < NUM_ROUNDS; i++) {
+        if (message_client(client, profile) == -1) {
+            perror("message_client");
+            exit(1);
+        }
+        drain(fds[1]);
+    }
+    elapsed = now_ns() - start;
+    printf("output queue: %.1f syscalls/response, %.0f ns/response\n",
+           (double)num_syscalls / NUM_ROUNDS, (double)elapsed / NUM_ROUNDS);
+
+    free(profile);
+    remove_client(client, &clients);
+    close(fds[1]);
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "friends.h"
+#include "bench_util.h"
+
+#define DEFAULT_NUM_POSTS 1000
+#define NUM_ROUNDS 20
+#define END_COMMAND "stats\r\n"       // Sent after the posts; its reply marks the end of a round
+#define END_REPLY "Profile cache"
+#define ENTERS_REPLY "Event loop: io_uring, "  // Followed by the server's io_uring_enter count
+
+
+/*
+ * Read from <fd> until <marker> has been received. Return the number of io_uring system calls
+ * reported by the stats reply that contains <marker>, or -1 if the server does not use io_uring.
+ */
+long read_until(int fd, const char *marker) {
+    size_t marker_len = strlen(marker);
+    StrBuf reply = {NULL, 0, 0};
+    char buf[4096];
+    size_t searched = 0;
+    while (1) {
+        ssize_t num_read = read(fd, buf, sizeof(buf));
+        if (num_read <= 0) {
+            fprintf(stderr, "server closed the connection\n");
+            exit(1);
+        }
+        append_str(&reply, buf, num_read);
+        if (strstr(&reply.data[searched], marker) != NULL) {
+            break;
+        }
+        // The next search starts far enough back to find a marker split between reads.
+        searched = reply.len < marker_len ? 0 : reply.len - marker_len;
+    }
+    // The server reports its event loop before the profile cache, so the line is complete.
+    const char *enters = strstr(reply.data, ENTERS_REPLY);
+    long num_enters = enters != NULL ? strtol(&enters[strlen(ENTERS_REPLY)], NULL, 10) : -1;
+    free(reply.data);
+    return num_enters;
+}
+
+
+/*
+ * Measure the commands per second friend_server handles for a client that pipelines <num_posts>
+ * posts in a single write, and with an io_uring server (-u), the io_uring_enter system calls it
+ * makes per command. A running server on PORT is required.
+ * Usage: bench_pipeline [num_posts]
+ */
+int main(int argc, char **argv) {
+    int num_posts = argc > 1 ? strtol(argv[1], NULL, 10) : DEFAULT_NUM_POSTS;
+
+    // Unique names so the benchmark can be run again against the same server.
+    char poster_name[MAX_NAME];
+    char target_name[MAX_NAME];
+    snprintf(poster_name, MAX_NAME, "bench_p%d", getpid());
+    snprintf(target_name, MAX_NAME, "bench_t%d", getpid());
+    int target = connect_as(target_name);
+    int poster = connect_as(poster_name);
+
+    char command[2 * MAX_NAME + 32];
+    int len = snprintf(command, sizeof(command), "make_friends %s\r\n" END_COMMAND, target_name);
+    write_all(poster, command, len);
+    long num_enters = read_until(poster, END_REPLY);
+
+    StrBuf batch = {NULL, 0, 0};
+    for (int i = 0; i < num_posts; i++) {
+        len = snprintf(command, sizeof(command), "post %s pipelined post %d\r\n", target_name, i);
+        append_str(&batch, command, len);
+    }
+    append_cstr(&batch, END_COMMAND);
+
+    long long best = 0;
+    long best_enters = -1;
+    for (int i = 0; i < NUM_ROUNDS; i++) {
+        long long start = now_ns();
+        write_all(poster, batch.data, batch.len);
+        long round_enters = read_until(poster, END_REPLY);
+        long long elapsed = now_ns() - start;
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+            best_enters = round_enters - num_enters;
+        }
+        num_enters = round_enters;
+        // Keep the target's notifications from piling up in the server.
+        drain(target);
+    }
+
+    printf("pipelined %d posts: best of %d: %.3f ms, %.0f commands/sec",
+           num_posts, NUM_ROUNDS, best / 1e6, (num_posts + 1) / (best / 1e9));
+    if (num_enters != -1) {
+        printf(", %.3f io_uring_enter calls/command", (double)best_enters / (num_posts + 1));
+    }
+    printf("\n");
+    free(batch.data);
+    close(poster);
+    close(target);
+    return 0;
+}
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "friends.h"
+#include "bench_util.h"
+
+#define DEFAULT_NUM_POSTS 10000
+#define NUM_ROUNDS 20
+
+
+/*
+ * Time rendering the profile of a user with <num_posts> posts, and sending it from the profile cache.
+ * Usage: bench_profile [num_posts]
+ */
+int main(int argc, char **argv) {
+    int num_posts = argc > 1 ? strtol(argv[1], NULL, 10) : DEFAULT_NUM_POSTS;
+
+    User *user_list = NULL;
+    create_user("author", &user_list);
+    create_user("reader", &user_list);
+    make_friends("author", "reader", user_list);
+    User *author = find_user("author", user_list);
+    User *reader = find_user("reader", user_list);
+    for (int i = 0; i < num_posts; i++) {
+        char *contents = malloc(64);
+        if (contents == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        snprintf(contents, 64, "post number %d from the benchmark", i);
+        make_post(author, reader, contents);
+    }
+
+    size_t profile_size = 0;
+    long long best = 0;
+    for (int i = 0; i < NUM_ROUNDS; i++) {
+        StrBuf buf = {NULL, 0, 0};
+        long long start = now_ns();
+        render_user(reader, &buf);
+        long long elapsed = now_ns() - start;
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+        profile_size = buf.len;
+        free(buf.data);
+    }
+    printf("render_user: %d posts, %zu bytes, best of %d: %.3f ms (%.0f ns/post)\n",
+           num_posts, profile_size, NUM_ROUNDS, best / 1e6, (double)best / (num_posts > 0 ? num_posts : 1));
+
+    // The first call renders the profile into the cache, the rest are cache hits.
+    for (int i = 0; i < NUM_ROUNDS; i++) {
+        long long start = now_ns();
+        char *profile = print_user(reader);
+        long long elapsed = now_ns() - start;
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+        free(profile);
+    }
+    unsigned long hits, misses;
+    profile_cache_stats(&hits, &misses);
+    printf("print_user (cached): best of %d: %.3f ms, %lu hits, %lu misses\n", NUM_ROUNDS, best / 1e6, hits, misses);
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "friends.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "bench_util.h"
+
+#define DEFAULT_NUM_USERS 100000
+#define DEFAULT_NUM_POSTS 1000000
+#define FRIENDS_PER_USER 4  // Each user befriends the next few users, so most have twice this many friends
+#define SNAPSHOT_PATH "bench_snapshot.snap"
+#define JOURNAL_PATH "bench_snapshot.journal"
+
+
+/*
+ * Build <num_users> users with their friendships and <num_posts> posts, recording every change
+ * in <journal>, and return the head of the list.
+ */
+User *build_users(long num_users, long num_posts, Journal *journal) {
+    User *user_list = NULL;
+    User **users = malloc(num_users * sizeof(User *));
+    if (users == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (long i = 0; i < num_users; i++) {
+        char name[MAX_NAME];
+        snprintf(name, MAX_NAME, "user%ld", i);
+        create_user(name, &user_list);
+        users[i] = find_user(name, user_list);
+        journal_create_user(journal, name);
+    }
+    for (long i = 0; i < num_users; i++) {
+        for (long j = 1; j <= FRIENDS_PER_USER && j < num_users; j++) {
+            const char *friend = users[(i + j) % num_users]->name;
+            if (make_friends(users[i]->name, friend, user_list) == 0) {
+                journal_make_friends(journal, users[i]->name, friend);
+            }
+        }
+        journal_commit(journal);
+    }
+
+    // Every tenth post is too long to be stored inline.
+    for (long i = 0; i < num_posts; i++) {
+        char contents[128];
+        int len = snprintf(contents, sizeof(contents), i % 10 == 0
+                           ? "post number %ld from the snapshot benchmark, long enough to be stored on the heap"
+                           : "post number %ld", i);
+        User *target = users[i % num_users];
+        User *author = users[(i / num_users + 1) % num_users];
+        if (!is_friend(target, author)) {
+            author = target->friends.members[0];
+        }
+        make_post_copy(author, target, contents, len);
+        journal_make_post(journal, target->name, target->first_post);
+        if (i % 10000 == 0) {
+            journal_commit(journal);
+        }
+    }
+    journal_commit(journal);
+    free(users);
+    return user_list;
+}
+
+
+/*
+ * Run <load> in a child process, so every measurement starts from an empty heap, and print how long it took.
+ */
+void time_in_child(const char *label, long (*load)()) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        long long start = now_ns();
+        long count = load();
+        long long elapsed = now_ns() - start;
+        if (count == -1) {
+            exit(1);
+        }
+        printf("%s: %.3f s\n", label, elapsed / 1e9);
+        exit(0);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed\n", label);
+        exit(1);
+    }
+}
+
+
+/*
+ * Load the snapshot, as friend_server does on startup.
+ */
+long load_from_snapshot() {
+    User *user_list = NULL;
+    off_t journal_offset;
+    return load_snapshot(SNAPSHOT_PATH, &user_list, &journal_offset);
+}
+
+
+/*
+ * Rebuild the users by replaying the whole journal, as friend_server did before snapshots.
+ */
+long load_from_journal() {
+    User *user_list = NULL;
+    Journal journal;
+    return journal_open(&journal, JOURNAL_PATH, DURABILITY_NONE, 0, &user_list);
+}
+
+
+/*
+ * Compare the startup time of loading a snapshot with replaying the journal.
+ * Usage: bench_snapshot [num_users] [num_posts]
+ */
+int main(int argc, char **argv) {
+    long num_users = argc > 1 ? strtol(argv[1], NULL, 10) : DEFAULT_NUM_USERS;
+    long num_posts = argc > 2 ? strtol(argv[2], NULL, 10) : DEFAULT_NUM_POSTS;
+    if (num_users < 2) {
+        fprintf(stderr, "bench_snapshot needs at least 2 users\n");
+        exit(1);
+    }
+
+    unlink(JOURNAL_PATH);
+    Journal journal;
+    User *empty_list = NULL;
+    if (journal_open(&journal, JOURNAL_PATH, DURABILITY_NONE, 0, &empty_list) == -1) {
+        exit(1);
+    }
+    long long start = now_ns();
+    User *user_list = build_users(num_users, num_posts, &journal);
+    printf("built %ld users and %ld posts in %.3f s, journal is %lld bytes\n",
+           num_users, num_posts, (now_ns() - start) / 1e9, (long long)journal.size);
+
+    start = now_ns();
+    if (save_snapshot(SNAPSHOT_PATH, user_list, journal.size) == -1) {
+        exit(1);
+    }
+    printf("save_snapshot: %.3f s\n", (now_ns() - start) / 1e9);
+    fflush(stdout);
+
+    time_in_child("load_snapshot", load_from_snapshot);
+    time_in_child("journal replay", load_from_journal);
+
+    unlink(SNAPSHOT_PATH);
+    unlink(JOURNAL_PATH);
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "friends.h"
+#include "bench_util.h"
+
+#ifndef PORT
+	#define PORT 59211
+#endif
+#define READY_REPLY "You may enter user commands now:\r\n"  // The last reply to a login
+
+
+/*
+ * Return the current monotonic time in nanoseconds.
+ */
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/*
+ * Connect to the friend_server on this machine at PORT, wait for its prompt and log in as <name>.
+ * Return the connected socket once the replies to the login have been read, so none of them is
+ * taken for the reply to a command. Waiting before the next connection also keeps the server's
+ * small listen backlog from overflowing.
+ */
+int connect_as(const char *name) {
+    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(PORT);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock_fd, (struct sockaddr *)&server, sizeof(server)) == -1) {
+        perror("connect (is friend_server running?)");
+        exit(1);
+    }
+    char prompt[64];
+    if (read(sock_fd, prompt, sizeof(prompt)) <= 0) {
+        fprintf(stderr, "server closed the connection\n");
+        exit(1);
+    }
+    char login[MAX_NAME + 2];
+    int len = snprintf(login, sizeof(login), "%s\r\n", name);
+    write_all(sock_fd, login, len);
+
+    // Keep the end of what has been read so a reply split between reads is still found.
+    char reply[256];
+    size_t kept = 0;
+    while (1) {
+        ssize_t num_read = read(sock_fd, &reply[kept], sizeof(reply) - kept - 1);
+        if (num_read <= 0) {
+            fprintf(stderr, "server closed the connection\n");
+            exit(1);
+        }
+        size_t reply_len = kept + num_read;
+        reply[reply_len] = '\0';
+        if (strstr(reply, READY_REPLY) != NULL) {
+            return sock_fd;
+        }
+        kept = reply_len < strlen(READY_REPLY) ? reply_len : strlen(READY_REPLY);
+        memmove(reply, &reply[reply_len - kept], kept);
+    }
+}
+
+
+/*
+ * Write the <len> bytes at <data> to <fd>, exiting if they cannot be written.
+ */
+void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t num_wrote = write(fd, data, len);
+        if (num_wrote == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(1);
+        }
+        data += num_wrote;
+        len -= num_wrote;
+    }
+}
+
+
+/*
+ * Read and discard everything waiting on <fd>.
+ */
+void drain(int fd) {
+    char buf[4096];
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+}
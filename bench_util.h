@@ -0,0 +1,35 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stddef.h>
+
+// Timing and socket helpers shared by the benchmarks.
+
+
+/*
+ * Return the current monotonic time in nanoseconds.
+ */
+long long now_ns();
+
+
+/*
+ * Connect to the friend_server on this machine at PORT, wait for its prompt and log in as <name>.
+ * Return the connected socket once the replies to the login have been read, so none of them is
+ * taken for the reply to a command. Waiting before the next connection also keeps the server's
+ * small listen backlog from overflowing.
+ */
+int connect_as(const char *name);
+
+
+/*
+ * Write the <len> bytes at <data> to <fd>, exiting if they cannot be written.
+ */
+void write_all(int fd, const char *data, size_t len);
+
+
+/*
+ * Read and discard everything waiting on <fd>.
+ */
+void drain(int fd);
+
+#endif
@@ -0,0 +1,558 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "client.h"
+#include "locks.h"
+#include "slab.h"
+
+size_t out_high_water = OUT_HIGH_WATER;
+size_t max_line_len = MAX_LINE_LEN;
+
+// Every Client comes from this pool. Each worker thread has its own, and a client is always
+// freed by the worker that accepted it.
+static __thread SlabPool client_pool = SLAB_POOL(Client);
+
+// The serial of the next client to connect, on any worker.
+static unsigned long next_serial = 1;
+
+
+/*
+ * Return a pointer to <len> bytes of free space at the tail of the output queue of <client>.
+ * The bytes are not part of the queue until they are committed by adding to client->out_end.
+ * Return NULL if more than out_high_water bytes offered to the kernel are still unsent. Only
+ * bytes already offered count, so a response of any size, or a pipelined burst of them batched
+ * in one pass, can be sent to a client that is keeping up.
+ */
+char *reserve_output(Client *client, size_t len) {
+    size_t queued = client->out_end - client->out_start;
+    if (client->out_offered > client->out_start && client->out_offered - client->out_start > out_high_water) {
+        fprintf(stderr, "[Server] Client %d is not reading its output, disconnecting\n", client->sock_fd);
+        return NULL;
+    }
+
+    if (client->out_end + len > client->out_cap) {
+        // Move the unsent bytes to the front of the buffer first, then grow it if that is not enough room.
+        memmove(client->out_buf, &client->out_buf[client->out_start], queued);
+        client->out_offered = client->out_offered > client->out_start ? client->out_offered - client->out_start : 0;
+        client->out_start = 0;
+        client->out_end = queued;
+
+        if (queued + len > client->out_cap) {
+            size_t new_cap = client->out_cap == 0 ? BUF_SIZE : client->out_cap;
+            while (new_cap < queued + len) {
+                new_cap *= 2;
+            }
+            char *out_buf = realloc(client->out_buf, new_cap);
+            if (out_buf == NULL) {
+                perror("output queue realloc");
+                exit(1);
+            }
+            client->out_buf = out_buf;
+            client->out_cap = new_cap;
+        }
+    }
+
+    return &client->out_buf[client->out_end];
+}
+
+/*
+ * Return a pointer to the free space at the end of the input buffer of <client> and set <room>
+ * to its size, making room by moving the unfinished line to the front or growing the buffer.
+ * Received bytes are added to the buffer by adding to client->in_end.
+ */
+char *reserve_input(Client *client, size_t *room) {
+    if (client->in_end == client->in_cap) {
+        size_t pending = client->in_end - client->in_start;
+        if (client->in_start > 0) {
+            // Move the unfinished line to the front.
+            memmove(client->in_data, &client->in_data[client->in_start], pending);
+            client->in_scanned -= client->in_start;
+            client->in_start = 0;
+            client->in_end = pending;
+        } else {
+            // The unfinished line fills the buffer. It is at most max_line_len plus its carriage
+            // return (next_line drops longer lines), so this much room always holds the whole line.
+            size_t new_cap = client->in_cap * 2;
+            if (new_cap > max_line_len + 2) {
+                new_cap = max_line_len + 2;
+            }
+            char *in_data = client->in_data == client->buf ? malloc(new_cap) : realloc(client->in_data, new_cap);
+            if (in_data == NULL) {
+                perror("input buffer malloc");
+                exit(1);
+            }
+            if (client->in_data == client->buf) {
+                memcpy(in_data, client->buf, pending);
+            }
+            client->in_data = in_data;
+            client->in_cap = new_cap;
+        }
+    }
+    *room = client->in_cap - client->in_end;
+    return &client->in_data[client->in_end];
+}
+
+
+/*
+ * Find the next complete line in the input buffer of <client>, resuming the search where the last
+ * one stopped. The line's network newline is replaced by a null terminator and the line is consumed.
+ * Return:
+ *   - 1 if there was a line; *line is set to it and *len to its length
+ *   - 0 if the rest of the buffer is an unfinished line
+ *   - -1 if the unfinished line is longer than max_line_len; it is dropped along with the rest of
+ *     the line as it arrives
+ */
+int next_line(Client *client, char **line, size_t *len) {
+    char *data = client->in_data;
+    char *newline;
+    while ((newline = memchr(&data[client->in_scanned], '\n', client->in_end - client->in_scanned)) != NULL) {
+        size_t newline_pos = newline - data;
+        client->in_scanned = newline_pos + 1;
+        if (client->discarding) {
+            // The end of the line that was too long. Anything after it is a new line.
+            client->discarding = 0;
+            client->in_start = client->in_scanned;
+            continue;
+        }
+        if (newline_pos > client->in_start && data[newline_pos - 1] == '\r') {
+            data[newline_pos - 1] = '\0';
+            *line = &data[client->in_start];
+            *len = newline_pos - 1 - client->in_start;
+            client->in_start = client->in_scanned;
+            return 1;
+        }
+        // A bare newline is part of the line.
+    }
+    client->in_scanned = client->in_end;
+
+    size_t pending = client->in_end - client->in_start;
+    if (client->discarding || pending > max_line_len + 1) {
+        // Drop what has arrived of the line. The rest of it is dropped as it arrives, up to the
+        // next newline.
+        int first_overflow = !client->discarding;
+        client->discarding = 1;
+        client->in_start = 0;
+        client->in_end = 0;
+        client->in_scanned = 0;
+        return first_overflow ? -1 : 0;
+    }
+
+    if (pending == 0) {
+        // Start again at the front of the buffer so it rarely has to be compacted.
+        client->in_start = 0;
+        client->in_end = 0;
+        client->in_scanned = 0;
+    }
+    return 0;
+}
+
+
+/*
+ * Add the <len> bytes at <data> to the tail of the output queue of <client>.
+ * Return 0 on success or -1 if the client is too far behind (see reserve_output).
+ */
+int queue_output(Client *client, const char *data, size_t len) {
+    char *dest = reserve_output(client, len);
+    if (dest == NULL) {
+        return -1;
+    }
+    memcpy(dest, data, len);
+    client->out_end += len;
+    return 0;
+}
+
+/*
+ * Write as much of the output queue of <client> as its socket accepts without blocking.
+ * If the client's table has a send_queued function, the queue is handed to it instead.
+ * Return 0 if the queue was written or the socket is full (the rest is written on the next writable event).
+ * Return -1 if the client was closed.
+ */
+int flush_client(Client *client) {
+    // Whatever is not sent now is waiting on the client.
+    client->out_offered = client->out_end;
+    if (client->table->send_queued != NULL) {
+        return client->table->send_queued(client);
+    }
+    while (client->out_start < client->out_end) {
+        ssize_t num_wrote = send(client->sock_fd, &client->out_buf[client->out_start],
+                                 client->out_end - client->out_start, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (num_wrote == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            // The client disconnected.
+            return -1;
+        }
+        client->out_start += num_wrote;
+    }
+
+    // Everything was written so the queue can start from the front of the buffer again.
+    client->out_start = 0;
+    client->out_end = 0;
+    client->out_offered = 0;
+    return 0;
+}
+
+/*
+ * Send a message to the client. <message> must be terminated by a newline character.
+ * Every newline is translated to a network newline as the message is copied into the client's
+ * output queue, and as much of the queue as the socket accepts is written with a single send;
+ * the rest is written by flush_client once the socket is writable.
+ * If the client's table batches output, the send is left to flush_pending_clients so every
+ * message queued for the client until then goes out together, unless half of out_high_water is
+ * already waiting, in which case the table's commit function is called and then it is sent now.
+ * Either way no response is sent before the changes it acknowledges are committed.
+ * Return 0 if the message was successful.
+ * Return -1 if the client was closed or is too far behind (this function does not handle removing the client).
+ */
+int message_client(Client *client, const char *message) {
+    size_t len = strlen(message);
+    if (len == 0) {
+        return 0;
+    }
+
+    // Each newline grows by a carriage return, and a network newline is added if the message is
+    // missing its terminating newline, so the translated size is known before copying.
+    size_t translated_len = len;
+    const char *line = message;
+    const char *newline;
+    while ((newline = memchr(line, '\n', &message[len] - line)) != NULL) {
+        translated_len++;
+        line = newline + 1;
+    }
+    if (line < &message[len]) {
+        translated_len += 2;
+    }
+    char *dest = reserve_output(client, translated_len);
+    if (dest == NULL) {
+        return -1;
+    }
+
+    char *out = dest;
+    line = message;
+    while ((newline = memchr(line, '\n', &message[len] - line)) != NULL) {
+        memcpy(out, line, newline - line);
+        out += newline - line;
+        *out++ = '\r';
+        *out++ = '\n';
+        line = newline + 1;
+    }
+    if (line < &message[len]) {
+        // The message does not have a terminating newline (which should not happen) so add one.
+        fprintf(stderr, "[Server] ERROR message has no terminating newline, adjusting\n");
+        memcpy(out, line, &message[len] - line);
+        out += &message[len] - line;
+        *out++ = '\r';
+        *out++ = '\n';
+    }
+    client->out_end += out - dest;
+
+    if (client->table->batch_output) {
+        if (!client->flush_pending) {
+            client->flush_pending = 1;
+            client->next_pending = client->table->pending;
+            client->table->pending = client;
+        }
+        // A client pipelining many commands is sent its responses before the end of the pass once
+        // enough are waiting, so they start counting against it only once they have been offered.
+        size_t offered = client->out_offered > client->out_start ? client->out_offered : client->out_start;
+        if (client->out_end - offered < out_high_water / 2) {
+            return 0;
+        }
+        // The responses may acknowledge changes made earlier in this pass.
+        if (client->table->commit != NULL) {
+            client->table->commit();
+        }
+    }
+    return flush_client(client);
+}
+
+/*
+ * Write the output queued for every client on the pending list of <clients> since the last call,
+ * with one flush per client. Clients that are found to be disconnected are marked closed.
+ * Must be called before reap_clients, since the pending list may hold clients marked closed.
+ */
+void flush_pending_clients(ClientTable *clients) {
+    Client *client = clients->pending;
+    clients->pending = NULL;
+    while (client != NULL) {
+        Client *next = client->next_pending;
+        client->flush_pending = 0;
+        if (!client->closed && flush_client(client) == -1) {
+            close_client(client, clients);
+        }
+        client = next;
+    }
+}
+
+/*
+ * Returns a pointer to the Client with a sock_fd that equals <sock_fd> from <clients>
+ * or NULL if no such client exists.
+ */
+Client *find_client_by_sockfd(int sock_fd, ClientTable *clients) {
+    if (sock_fd < 0 || sock_fd >= clients->capacity) {
+        return NULL;
+    }
+    return clients->by_fd[sock_fd];
+}
+
+/*
+ * Marks <client> as closed so it is removed by reap_clients at the end of the current
+ * event loop pass. Does nothing if the client is already marked closed.
+ */
+void close_client(Client *client, ClientTable *clients) {
+    if (!client->closed) {
+        client->closed = 1;
+        client->next_closed = clients->closed;
+        clients->closed = client;
+    }
+}
+
+/*
+ * Push <message> for the client with socket <sock_fd> and serial <serial> onto the mailbox of
+ * <owner>, the table the client is in, and wake the worker that owns it if its mailbox was empty.
+ * Any thread may call this. The mail takes ownership of <message>, which must be heap allocated.
+ */
+void post_mail(ClientTable *owner, int sock_fd, unsigned long serial, char *message) {
+    Mail *mail = malloc(sizeof(Mail));
+    if (mail == NULL) {
+        perror("mail malloc");
+        exit(1);
+    }
+    mail->sock_fd = sock_fd;
+    mail->serial = serial;
+    mail->message = message;
+
+    // The owner may take and free the mail as soon as it is pushed, so the old head is kept here.
+    Mail *head = __atomic_load_n(&owner->mailbox, __ATOMIC_RELAXED);
+    do {
+        mail->next = head;
+    } while (!__atomic_compare_exchange_n(&owner->mailbox, &head, mail, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(owner->wake_fd, &one, sizeof(one)) == -1) {
+            perror("write eventfd");
+        }
+    }
+}
+
+/*
+ * Send a message to all connected clients logged in as <user>. <clients> is the table of the
+ * calling worker; sessions in other workers' tables are sent the message through their mailboxes.
+ * Clients that are found to be disconnected are marked closed and are removed by reap_clients.
+ * Locks the user's sessions, so the caller must not hold the user's lock.
+ */
+void message_to_user(User *user, ClientTable *clients, const char *message) {
+    lock_user(user);
+    for (Client *curr = user->first_session; curr != NULL; curr = curr->next_session) {
+        if (curr->table != clients) {
+            // Another worker's client, so the message is copied into its mailbox.
+            size_t len = strlen(message);
+            char *copy = malloc(len + 1);
+            if (copy == NULL) {
+                perror("mail malloc");
+                exit(1);
+            }
+            memcpy(copy, message, len + 1);
+            post_mail(curr->table, curr->sock_fd, curr->serial, copy);
+        } else if (!curr->closed && message_client(curr, message) == -1) {
+            // We tried to send the message but the Client disconnected.
+            close_client(curr, clients);
+        }
+    }
+    unlock_user(user);
+}
+
+/*
+ * Send every message in the mailbox of <clients> to the client it is for, skipping clients that
+ * have disconnected since it was sent. Must be called by the worker that owns <clients>.
+ */
+void deliver_mail(ClientTable *clients) {
+    // Reset the wakeup before taking the mail, so mail posted after this gets a new wakeup.
+    uint64_t count;
+    if (read(clients->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read eventfd");
+    }
+
+    // Take the whole mailbox and put it back in the order it was posted.
+    Mail *mail = __atomic_exchange_n(&clients->mailbox, NULL, __ATOMIC_ACQUIRE);
+    Mail *in_order = NULL;
+    while (mail != NULL) {
+        Mail *next = mail->next;
+        mail->next = in_order;
+        in_order = mail;
+        mail = next;
+    }
+
+    while (in_order != NULL) {
+        Mail *next = in_order->next;
+        Client *client = find_client_by_sockfd(in_order->sock_fd, clients);
+        if (client != NULL && client->serial == in_order->serial && !client->closed
+                && message_client(client, in_order->message) == -1) {
+            close_client(client, clients);
+        }
+        free(in_order->message);
+        free(in_order);
+        in_order = next;
+    }
+}
+
+/*
+ * Adds <client> to the sessions of <user>.
+ */
+void attach_session(Client *client, User *user) {
+    lock_user(user);
+    client->user = user;
+    client->prev_session = NULL;
+    client->next_session = user->first_session;
+    if (user->first_session != NULL) {
+        user->first_session->prev_session = client;
+    }
+    user->first_session = client;
+    unlock_user(user);
+}
+
+/*
+ * Adds a client with socket <client_fd> to the tail of <clients> with no user (this function
+ * is used for new connections before they have sent their username)
+ * Returns the new client.
+ */
+Client *add_client(ClientTable *clients, int client_fd) {
+    // Create the Client struct
+    Client *new_client = slab_alloc(&client_pool);
+
+    // Initialize the struct values
+    new_client->sock_fd = client_fd;
+    new_client->serial = __atomic_fetch_add(&next_serial, 1, __ATOMIC_RELAXED);
+    new_client->in_data = new_client->buf;
+    new_client->in_cap = BUF_SIZE;
+    new_client->in_start = 0;
+    new_client->in_end = 0;
+    new_client->in_scanned = 0;
+    new_client->discarding = 0;
+    new_client->out_buf = NULL;
+    new_client->out_start = 0;
+    new_client->out_end = 0;
+    new_client->out_offered = 0;
+    new_client->out_cap = 0;
+    new_client->send_buf = NULL;
+    new_client->send_start = 0;
+    new_client->send_end = 0;
+    new_client->send_cap = 0;
+    new_client->uring_ops = 0;
+    new_client->closed = 0;
+    new_client->flush_pending = 0;
+    new_client->table = clients;
+    new_client->user = NULL;
+    new_client->next_session = NULL;
+    new_client->prev_session = NULL;
+    new_client->next_closed = NULL;
+    new_client->next_pending = NULL;
+
+    // Grow the fd index so it covers client_fd.
+    if (client_fd >= clients->capacity) {
+        int new_capacity = clients->capacity == 0 ? 64 : clients->capacity;
+        while (new_capacity <= client_fd) {
+            new_capacity *= 2;
+        }
+        Client **by_fd = realloc(clients->by_fd, new_capacity * sizeof(Client *));
+        if (by_fd == NULL) {
+            perror("client table realloc");
+            exit(1);
+        }
+        memset(&by_fd[clients->capacity], 0, (new_capacity - clients->capacity) * sizeof(Client *));
+        clients->by_fd = by_fd;
+        clients->capacity = new_capacity;
+    }
+    clients->by_fd[client_fd] = new_client;
+
+    // Insert the new client at the tail of the linked list.
+    new_client->next_client = NULL;
+    new_client->prev_client = clients->tail;
+    if (clients->tail != NULL) {
+        clients->tail->next_client = new_client;
+    } else {
+        clients->head = new_client;
+    }
+    clients->tail = new_client;
+
+    return new_client;
+}
+
+
+/*
+ * Removes <client> from <clients> and from its user's sessions, closing its socket
+ * and freeing its memory. If io_uring requests for the client are still in flight, its socket is
+ * shut down so they complete, and the client is left for free_client; its sock_fd is set to -1.
+ */
+void remove_client(Client *client, ClientTable *clients) {
+    if (client->prev_client != NULL) {
+        client->prev_client->next_client = client->next_client;
+    } else {
+        clients->head = client->next_client;
+    }
+    if (client->next_client != NULL) {
+        client->next_client->prev_client = client->prev_client;
+    } else {
+        clients->tail = client->prev_client;
+    }
+
+    if (client->user != NULL) {
+        lock_user(client->user);
+        if (client->prev_session != NULL) {
+            client->prev_session->next_session = client->next_session;
+        } else {
+            client->user->first_session = client->next_session;
+        }
+        if (client->next_session != NULL) {
+            client->next_session->prev_session = client->prev_session;
+        }
+        unlock_user(client->user);
+    }
+
+    clients->by_fd[client->sock_fd] = NULL;
+    if (client->uring_ops > 0) {
+        // The requests in flight hold the socket open until they complete, which shutting it
+        // down makes them do.
+        shutdown(client->sock_fd, SHUT_RDWR);
+    }
+    // Closing the socket also removes it from the epoll interest list.
+    close(client->sock_fd);
+    client->sock_fd = -1;
+    free(client->out_buf);
+    client->out_buf = NULL;
+    if (client->in_data != client->buf) {
+        free(client->in_data);
+    }
+    if (client->uring_ops == 0) {
+        free_client(client);
+    }
+}
+
+/*
+ * Free <client>, which remove_client left behind, once its last io_uring request has completed.
+ */
+void free_client(Client *client) {
+    free(client->send_buf);
+    slab_free(&client_pool, client);
+}
+
+/*
+ * Removes every client marked closed from <clients>.
+ */
+void reap_clients(ClientTable *clients) {
+    while (clients->closed != NULL) {
+        Client *client = clients->closed;
+        clients->closed = client->next_closed;
+        printf("[Server] Client %d disconnected\n", client->sock_fd);
+        remove_client(client, clients);
+    }
+}
+
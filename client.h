@@ -0,0 +1,240 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stddef.h>
+#include "friends.h"
+
+#define BUF_SIZE 256
+#define OUT_HIGH_WATER (1 << 20)  // Default max bytes queued for a client before it is disconnected
+#define MAX_LINE_LEN 4096  // Default max bytes in a line from a client, not counting its network newline
+
+// This struct forms a doubly linked list structure where each item contains a User, a buffer
+// exclusively for this user, an int keeping track of how many bytes are in the buffer
+// and a sockfd for the current active connection for this user
+// (or -1 if no active connection)
+// Every client logged in as a user is also linked into that user's list of sessions
+// (User.first_session) so notifying a user only touches that user's connections.
+// A client whose connection failed while the server was writing to it is marked <closed> rather than
+// freed immediately, since other code (including the pending events of the current event loop pass)
+// may still hold a pointer to it. Closed clients are reaped at the end of each event loop pass.
+// Sockets are non-blocking, so output that cannot be written immediately waits in out_buf
+// (bytes [out_start, out_end)) until the socket becomes writable again. Bytes before out_offered
+// have been offered to the kernel by flush_client; only those count when deciding whether the
+// client is too far behind, since batched output waits for the end of the pass before it is sent.
+// Input is received into in_data: bytes [in_start, in_end) have been received but not processed yet.
+// Lines are consumed by advancing in_start, so nothing is moved per line; the unfinished line is only
+// moved to the front when the buffer runs out of room at its end. in_data starts as the embedded <buf>
+// and is replaced by a growing heap buffer for lines longer than BUF_SIZE, up to max_line_len.
+// With the io_uring backend, output being sent is moved out of the queue to send_buf (bytes
+// [send_start, send_end)) so the kernel can read it while new output is queued, and the client
+// counts its requests in flight in uring_ops; it is only freed once they have all completed.
+// Clients are allocated from a slab pool.
+// With several worker threads each client belongs to the table of the worker that accepted it, and
+// only that worker touches its buffers. <serial> tells a client apart from a later one on the same fd.
+typedef struct client_connection {
+    int sock_fd;
+    unsigned long serial;
+    char buf[BUF_SIZE];
+    char *in_data;
+    size_t in_cap;
+    size_t in_start;
+    size_t in_end;
+    size_t in_scanned;  // Bytes before this are known not to end a line, so scanning resumes here
+    int discarding;     // Set while the rest of a line that is too long is dropped
+    char *out_buf;
+    size_t out_start;
+    size_t out_end;
+    size_t out_offered;
+    size_t out_cap;
+    char *send_buf;
+    size_t send_start;
+    size_t send_end;
+    size_t send_cap;
+    int uring_ops;
+    int closed;
+    int flush_pending;  // Set while the client is on its table's pending list
+    struct client_table *table;
+    User *user;
+    struct client_connection *next_client;
+    struct client_connection *prev_client;
+    struct client_connection *next_session;
+    struct client_connection *prev_session;
+    struct client_connection *next_closed;
+    struct client_connection *next_pending;
+} Client;
+
+// A message for a client from another thread, waiting in the mailbox of the client's worker.
+typedef struct mail {
+    struct mail *next;
+    int sock_fd;            // The client it is for, which may have disconnected since
+    unsigned long serial;
+    char *message;          // Heap allocated, freed once the mail is delivered
+} Mail;
+
+// Every connected client, indexed by socket fd and kept in connection order.
+// Other workers send messages to these clients by pushing them onto <mailbox> without a lock and
+// writing to <wake_fd> (an eventfd, or -1 with a single worker) when the mailbox was empty.
+typedef struct client_table {
+    Client **by_fd;       // by_fd[fd] is the client with socket fd or NULL
+    int capacity;         // Number of entries in by_fd
+    Client *head;
+    Client *tail;
+    Client *closed;       // Clients marked closed that have not been reaped yet
+    int batch_output;     // Set to leave queued output for flush_pending_clients instead of sending it at once
+    Client *pending;      // Clients with output queued since the last flush_pending_clients
+    Mail *mailbox;        // Messages from other workers, newest first
+    int wake_fd;
+    int (*send_queued)(Client *client);  // If set, called by flush_client to send instead of send()
+    void (*commit)();     // If set, called before batched output is sent early, to commit what it acknowledges
+} ClientTable;
+
+// Max number of bytes that may be waiting in a client's output queue. A client that stops reading
+// while the server keeps writing to it is disconnected once this is exceeded.
+extern size_t out_high_water;
+
+// Max number of bytes in a line from a client, not counting its network newline. Longer lines
+// are dropped with an error instead of being buffered.
+extern size_t max_line_len;
+
+
+/*
+ * Return a pointer to the free space at the end of the input buffer of <client> and set <room>
+ * to its size, making room by moving the unfinished line to the front or growing the buffer.
+ * Received bytes are added to the buffer by adding to client->in_end.
+ */
+char *reserve_input(Client *client, size_t *room);
+
+
+/*
+ * Find the next complete line in the input buffer of <client>, resuming the search where the last
+ * one stopped. The line's network newline is replaced by a null terminator and the line is consumed.
+ * Return:
+ *   - 1 if there was a line; *line is set to it and *len to its length
+ *   - 0 if the rest of the buffer is an unfinished line
+ *   - -1 if the unfinished line is longer than max_line_len; it is dropped along with the rest of
+ *     the line as it arrives
+ */
+int next_line(Client *client, char **line, size_t *len);
+
+
+/*
+ * Return a pointer to <len> bytes of free space at the tail of the output queue of <client>.
+ * The bytes are not part of the queue until they are committed by adding to client->out_end.
+ * Return NULL if more than out_high_water bytes offered to the kernel are still unsent. Only
+ * bytes already offered count, so a response of any size, or a pipelined burst of them batched
+ * in one pass, can be sent to a client that is keeping up.
+ */
+char *reserve_output(Client *client, size_t len);
+
+
+/*
+ * Add the <len> bytes at <data> to the tail of the output queue of <client>.
+ * Return 0 on success or -1 if the client is too far behind (see reserve_output).
+ */
+int queue_output(Client *client, const char *data, size_t len);
+
+
+/*
+ * Write as much of the output queue of <client> as its socket accepts without blocking.
+ * If the client's table has a send_queued function, the queue is handed to it instead.
+ * Return 0 if the queue was written or the socket is full (the rest is written on the next writable event).
+ * Return -1 if the client was closed.
+ */
+int flush_client(Client *client);
+
+
+/*
+ * Send a message to the client. <message> must be terminated by a newline character.
+ * Every newline is translated to a network newline as the message is copied into the client's
+ * output queue, and as much of the queue as the socket accepts is written with a single send;
+ * the rest is written by flush_client once the socket is writable.
+ * If the client's table batches output, the send is left to flush_pending_clients so every
+ * message queued for the client until then goes out together, unless half of out_high_water is
+ * already waiting, in which case the table's commit function is called and then it is sent now.
+ * Either way no response is sent before the changes it acknowledges are committed.
+ * Return 0 if the message was successful.
+ * Return -1 if the client was closed or is too far behind (this function does not handle removing the client).
+ */
+int message_client(Client *client, const char *message);
+
+
+/*
+ * Write the output queued for every client on the pending list of <clients> since the last call,
+ * with one flush per client. Clients that are found to be disconnected are marked closed.
+ * Must be called before reap_clients, since the pending list may hold clients marked closed.
+ */
+void flush_pending_clients(ClientTable *clients);
+
+
+/*
+ * Returns a pointer to the Client with a sock_fd that equals <sock_fd> from <clients>
+ * or NULL if no such client exists.
+ */
+Client *find_client_by_sockfd(int sock_fd, ClientTable *clients);
+
+
+/*
+ * Marks <client> as closed so it is removed by reap_clients at the end of the current
+ * event loop pass. Does nothing if the client is already marked closed.
+ */
+void close_client(Client *client, ClientTable *clients);
+
+
+/*
+ * Send a message to all connected clients logged in as <user>. <clients> is the table of the
+ * calling worker; sessions in other workers' tables are sent the message through their mailboxes.
+ * Clients that are found to be disconnected are marked closed and are removed by reap_clients.
+ * Locks the user's sessions, so the caller must not hold the user's lock.
+ */
+void message_to_user(User *user, ClientTable *clients, const char *message);
+
+
+/*
+ * Push <message> for the client with socket <sock_fd> and serial <serial> onto the mailbox of
+ * <owner>, the table the client is in, and wake the worker that owns it if its mailbox was empty.
+ * Any thread may call this. The mail takes ownership of <message>, which must be heap allocated.
+ */
+void post_mail(ClientTable *owner, int sock_fd, unsigned long serial, char *message);
+
+
+/*
+ * Send every message in the mailbox of <clients> to the client it is for, skipping clients that
+ * have disconnected since it was sent. Must be called by the worker that owns <clients>.
+ */
+void deliver_mail(ClientTable *clients);
+
+
+/*
+ * Adds <client> to the sessions of <user>.
+ */
+void attach_session(Client *client, User *user);
+
+
+/*
+ * Adds a client with socket <client_fd> to the tail of <clients> with no user (this function
+ * is used for new connections before they have sent their username)
+ * Returns the new client.
+ */
+Client *add_client(ClientTable *clients, int client_fd);
+
+
+/*
+ * Removes <client> from <clients> and from its user's sessions, closing its socket
+ * and freeing its memory. If io_uring requests for the client are still in flight, its socket is
+ * shut down so they complete, and the client is left for free_client; its sock_fd is set to -1.
+ */
+void remove_client(Client *client, ClientTable *clients);
+
+
+/*
+ * Free <client>, which remove_client left behind, once its last io_uring request has completed.
+ */
+void free_client(Client *client);
+
+
+/*
+ * Removes every client marked closed from <clients>.
+ */
+void reap_clients(ClientTable *clients);
+
+#endif
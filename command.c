@@ -0,0 +1,160 @@
+#include <string.h>
+#include <limits.h>
+#include "command.h"
+
+
+/*
+ * Return 1 if <c> separates tokens and 0 otherwise.
+ */
+static int is_delim(char c) {
+    return c == ' ' || c == '\n';
+}
+
+
+/*
+ * Start splitting the <len> bytes at <line> into tokens.
+ */
+void tokenizer_init(Tokenizer *tokenizer, const char *line, size_t len) {
+    tokenizer->pos = line;
+    tokenizer->end = line + len;
+}
+
+
+/*
+ * Set <token> to the next token of the line.
+ * Return 1 if there was a token or 0 if the line has no tokens left.
+ */
+int next_token(Tokenizer *tokenizer, Slice *token) {
+    const char *pos = tokenizer->pos;
+    const char *end = tokenizer->end;
+    while (pos < end && is_delim(*pos)) {
+        pos++;
+    }
+    token->data = pos;
+    while (pos < end && !is_delim(*pos)) {
+        pos++;
+    }
+    token->len = pos - token->data;
+    tokenizer->pos = pos;
+    return token->len > 0;
+}
+
+
+/*
+ * Read the next <num_args> tokens of the line into <args>.
+ * Return 0 if the line has exactly that many tokens left and -1 if it has more or fewer.
+ */
+int exact_args(Tokenizer *tokenizer, Slice *args, int num_args) {
+    for (int i = 0; i < num_args; i++) {
+        if (!next_token(tokenizer, &args[i])) {
+            return -1;
+        }
+    }
+    Slice extra;
+    return next_token(tokenizer, &extra) ? -1 : 0;
+}
+
+
+/*
+ * Return the rest of the line, without the delimiters around it, as one slice. The whitespace
+ * between its words is kept as it was typed. The slice is empty if there are no tokens left.
+ */
+Slice rest_of_line(Tokenizer *tokenizer) {
+    Slice rest;
+    const char *end = tokenizer->end;
+    next_token(tokenizer, &rest);
+    while (end > rest.data && is_delim(end[-1])) {
+        end--;
+    }
+    rest.len = end - rest.data;
+    tokenizer->pos = tokenizer->end;
+    return rest;
+}
+
+
+/*
+ * Return <command> if <name> is spelled <word> and CMD_UNKNOWN otherwise.
+ */
+static Command match(Slice name, const char *word, Command command) {
+    return memcmp(name.data, word, name.len) == 0 ? command : CMD_UNKNOWN;
+}
+
+
+/*
+ * Return the command named by <name>, or CMD_UNKNOWN if it does not name a command.
+ * The length and first letter pick at most one candidate, so only one comparison is made.
+ */
+Command lookup_command(Slice name) {
+    switch (name.len) {
+        case 4:
+            switch (name.data[0]) {
+                case 'q':
+                    return match(name, "quit", CMD_QUIT);
+                case 'p':
+                    return match(name, "post", CMD_POST);
+                case 's':
+                    return match(name, "save", CMD_SAVE);
+                case 'f':
+                    return match(name, "feed", CMD_FEED);
+            }
+            break;
+        case 5:
+            switch (name.data[0]) {
+                case 's':
+                    return match(name, "stats", CMD_STATS);
+                case 'p':
+                    return match(name, "posts", CMD_POSTS);
+            }
+            break;
+        case 7:
+            switch (name.data[0]) {
+                case 'p':
+                    return match(name, "profile", CMD_PROFILE);
+                case 's':
+                    return match(name, "suggest", CMD_SUGGEST);
+            }
+            break;
+        case 8:
+            return match(name, "add_user", CMD_ADD_USER);
+        case 10:
+            return match(name, "list_users", CMD_LIST_USERS);
+        case 12:
+            return match(name, "make_friends", CMD_MAKE_FRIENDS);
+    }
+    return CMD_UNKNOWN;
+}
+
+
+/*
+ * Set <number> to the non-negative decimal number spelled by <token>.
+ * Return 0 if <token> is only digits and fits in an unsigned int, and -1 otherwise.
+ */
+int parse_number(Slice token, unsigned int *number) {
+    unsigned long value = 0;
+    if (token.len == 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < token.len; i++) {
+        if (token.data[i] < '0' || token.data[i] > '9') {
+            return -1;
+        }
+        value = value * 10 + (token.data[i] - '0');
+        if (value > UINT_MAX) {
+            return -1;
+        }
+    }
+    *number = value;
+    return 0;
+}
+
+
+/*
+ * Copy <token> into <name>, which has room for MAX_NAME + 1 bytes, and null terminate it.
+ * A token too long to be a username is cut short, but is still too long, so it never names
+ * an existing user and create_user rejects it.
+ */
+void copy_name(Slice token, char *name) {
+    size_t len = token.len > MAX_NAME ? MAX_NAME : token.len;
+    memcpy(name, token.data, len);
+    name[len] = '\0';
+}
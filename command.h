@@ -0,0 +1,84 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stddef.h>
+#include "friends.h"
+
+// A run of <len> bytes at <data> inside a line of input. Slices are not null terminated.
+typedef struct slice {
+    const char *data;
+    size_t len;
+} Slice;
+
+// A position in a line of input being split into space separated tokens. Tokens are returned as
+// slices of the line itself, so nothing is copied and the line is never modified.
+typedef struct tokenizer {
+    const char *pos;
+    const char *end;
+} Tokenizer;
+
+// Every command understood by friend_server or friendme. Each program handles its own subset.
+typedef enum {
+    CMD_UNKNOWN,
+    CMD_QUIT,
+    CMD_ADD_USER,
+    CMD_LIST_USERS,
+    CMD_MAKE_FRIENDS,
+    CMD_POST,
+    CMD_PROFILE,
+    CMD_STATS,
+    CMD_SAVE,
+    CMD_FEED,
+    CMD_POSTS,
+    CMD_SUGGEST
+} Command;
+
+
+/*
+ * Start splitting the <len> bytes at <line> into tokens.
+ */
+void tokenizer_init(Tokenizer *tokenizer, const char *line, size_t len);
+
+
+/*
+ * Set <token> to the next token of the line.
+ * Return 1 if there was a token or 0 if the line has no tokens left.
+ */
+int next_token(Tokenizer *tokenizer, Slice *token);
+
+
+/*
+ * Read the next <num_args> tokens of the line into <args>.
+ * Return 0 if the line has exactly that many tokens left and -1 if it has more or fewer.
+ */
+int exact_args(Tokenizer *tokenizer, Slice *args, int num_args);
+
+
+/*
+ * Return the rest of the line, without the delimiters around it, as one slice. The whitespace
+ * between its words is kept as it was typed. The slice is empty if there are no tokens left.
+ */
+Slice rest_of_line(Tokenizer *tokenizer);
+
+
+/*
+ * Return the command named by <name>, or CMD_UNKNOWN if it does not name a command.
+ */
+Command lookup_command(Slice name);
+
+
+/*
+ * Set <number> to the non-negative decimal number spelled by <token>.
+ * Return 0 if <token> is only digits and fits in an unsigned int, and -1 otherwise.
+ */
+int parse_number(Slice token, unsigned int *number);
+
+
+/*
+ * Copy <token> into <name>, which has room for MAX_NAME + 1 bytes, and null terminate it.
+ * A token too long to be a username is cut short, but is still too long, so it never names
+ * an existing user and create_user rejects it.
+ */
+void copy_name(Slice token, char *name);
+
+#endif
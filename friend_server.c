@@ -3,188 +3,120 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "friends.h"
-
+#include "client.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "command.h"
+#include "locks.h"
+#include "render_pool.h"
+#include "uring.h"
+
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#ifndef USE_SELECT
+#include <sys/epoll.h>
+#endif
 
 #ifndef PORT
 	#define PORT 59211
 #endif
-#define DELIM " \n"
-#define BUF_SIZE 256
-#define INPUT_ARG_MAX_NUM 12
 #define MAX_BACKLOG 5
-
-// This struct forms a linked list structure where each item contains a User, a buffer
-// exclusively for this user, an int keeping track of how many bytes are in the buffer
-// and a sockfd for the current active connection for this user
-// (or -1 if no active connection)
-typedef struct client_connection {
-    int sock_fd;
-    char *buf;
-    int in_buf;
-    User *user;
-    struct client_connection *next_client;
-} Client;
-
+#define MAX_EVENTS 64  // Max number of ready events handled per epoll_wait call
+#define DEFAULT_SNAPSHOT_INTERVAL 300  // Seconds between snapshots while there are unsaved changes
+#define MAX_WORKERS 64
+#define DEFAULT_FEED_POSTS 10    // Posts sent by feed when no number is given
+#define DEFAULT_PAGE_POSTS 10    // Posts on a page of a profile when an offset but no limit is given
+#define DEFAULT_SUGGESTIONS 10   // Users suggested by suggest when no number is given
+#define URING_ENTRIES 1024       // Submission queue entries of each worker's io_uring
+#define URING_BUFFERS 1024       // Provided receive buffers of each worker's io_uring, a power of two
+#define URING_BUFFER_SIZE 4096
+
+// What an io_uring request is for, kept in the low bits of its user_data. The rest is the Client
+// the request is for, if any; clients come from a slab pool and are 16 byte aligned.
+#define URING_ACCEPT 1
+#define URING_RECV 2
+#define URING_SEND 3
+#define URING_WAKE 4
+#define URING_SAVE 5
+#define URING_TAG_MASK 15
+
+// A worker thread with its own listening socket (all bound to PORT with SO_REUSEPORT, so the
+// kernel spreads new connections over the workers), its own event loop and its own clients.
+// Worker 0 runs on the main thread and is the only one that takes snapshots.
+typedef struct worker {
+    pthread_t thread;
+    int listen_fd;
+    ClientTable clients;
+    User **user_list;
+} Worker;
+
+static Worker workers[MAX_WORKERS];
+static int num_workers = 1;
+
+// Number of threads rendering profiles that are not cached, or 0 to render them on the worker (no -r).
+// Rendered profiles come back through the worker's mailbox, so they can be sent after the
+// responses to commands the client sent after the profile command.
+static int render_threads = 0;
+
+// Set to run the io_uring event loop instead of epoll or select (-u).
+static int use_uring = 0;
+
+// The io_uring of the worker running on this thread, while it runs the io_uring event loop.
+static __thread Uring *worker_ring = NULL;
+
+// Mutual friend counts for suggest, reused by every suggest the worker on this thread handles.
+static __thread MutualCounts mutual_counts = {NULL, 0, NULL, 0, 0};
+
+// The journal every change to the users is recorded in, or NULL if journaling is disabled (no -j).
+static Journal *journal = NULL;
+
+// Where the users are periodically snapshotted, or NULL if snapshots are disabled (no -s).
+static const char *snapshot_path = NULL;
+static int snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+static time_t next_snapshot;            // When the next snapshot is due
+static unsigned long unsaved_changes = 0;  // Changes to the users since the last snapshot, updated atomically
+static int save_requested = 0;             // Set by the save command to snapshot at the end of the pass
+static BackgroundSave background_save = {.pid = 0, .result_fd = -1};  // Written with the users locked exclusively
+static unsigned long changes_in_save = 0;  // Changes reflected in the snapshot being saved
 
 /*
- * Send a message to the client with write. <message> must be terminated by a newline character.
- * Return 0 if the message was successful.
- * Return -1 if the client was closed (this function does not handle removing the client).
+ * Wake worker 0 so it works out when the next snapshot is due. Does nothing with a single worker,
+ * since it already does that at the end of the pass that changed something.
  */
-int message_client(Client *client, char *message) {
-    // Make a copy of the message that is guaranteed to be mutable for this function to use.
-    char mutable_msg[strlen(message) + 1];
-    strncpy(mutable_msg, message, strlen(message) + 1);
-
-    // We need to send each line from list_users as a separate message to ensure we don't go past the buffer size.
-    // Stores the index of the start of the line in mutable_msg (for multiple lines)
-    int line_start = 0;
-    // Stores the index of the newline character (the end of the line).
-    int where = 0;
-    while ((line_start < strlen(message) - 1) && (where = strchrnul(&mutable_msg[line_start], '\n') - mutable_msg) != 0) {
-        // If the message to send does not have a terminating newline (which should not happen) truncate the last message to
-        // add a newline character in.
-        if (where >= strlen(message)) {
-            fprintf(stderr, "[Server] ERROR message has no terminating newline, adjusting\n");
-            where = strlen(message) - 1;
-        }
-
-        // Null terminate the message at the newline to separate it from the other lines
-        // so string functions can be used below
-        mutable_msg[where] = '\0';
-        // line will contain the full line to send including the null terminator and the network newline
-        char line[where - line_start + 3];
-        strncpy(line, &mutable_msg[line_start], where - line_start);
-        line[where - line_start] = '\r';
-        line[where - line_start + 1] = '\n';
-        line[where - line_start + 2] = '\0';
-
-        // Write in a loop to ensure the message is written.
-        int num_to_write = strlen(line);
-        int num_wrote = 0;
-        while ((num_wrote = write(client->sock_fd, &line[num_wrote], num_to_write)) < num_to_write) {
-            if (num_wrote == -1) {
-                // The client disconnected.
-                return -1;
-            }
-            // Update what's left to write.
-            num_to_write -= num_wrote;
-        }
-
-        // Set the start of the message to be the next character (start of another line or null terminator)
-        if (where < strlen(message)) {
-            line_start = where + 1;
+void wake_snapshot_worker() {
+    if (workers[0].clients.wake_fd != -1) {
+        uint64_t one = 1;
+        if (write(workers[0].clients.wake_fd, &one, sizeof(one)) == -1) {
+            perror("write eventfd");
         }
     }
-
-    return 0;
-}
-
-/*
- * Returns a pointer to the Client with a user that has username <username> from the
- * linked list structure <client_list> or NULL if no such user exists.
- */
-Client *find_client_by_username(char *username, Client *client_list) {
-    while (client_list != NULL) {
-        if (strcmp(client_list->user->name, username) == 0) {
-            return client_list;
-        }
-        client_list = client_list->next_client;
-    }
-
-    return NULL;
-}
-
-/*
- * Returns a pointer to the Client with a sock_fd that equals <sock_fd> from the
- * linked list structure <client_list> or NULL if no such client exists.
- */
-Client *find_client_by_sockfd(int sock_fd, Client *client_list) {
-    while (client_list != NULL) {
-        if (client_list->sock_fd == sock_fd) {
-            return client_list;
-        }
-        client_list = client_list->next_client;
-    }
-
-    return NULL;
-}
-
-/*
- * Removes the client specified by the file descriptor <sock_fd> from the linked list
- * <client_list> as this client is no longer connected.
- * Does nothing if no client has <sock_fd> as their file descriptor.
- * <client_list> must not be NULL.
- * Returns the head of the client_list with the client removed.
- */
-Client *remove_client(int sock_fd, Client *client_list) {
-    if (client_list->sock_fd == sock_fd) {
-        Client *new_head = client_list->next_client;
-
-        // Free the string buffer for the client.
-        free(client_list->buf);
-        free(client_list);
-
-        return new_head;
-    }
-
-    Client *prev = client_list;
-    Client *curr = client_list->next_client;
-
-    // Loop through to find the client with the sock_fd
-    while (curr != NULL && curr->sock_fd != sock_fd) {
-        prev = curr;
-        curr = curr->next_client;
-    }
-
-    if (curr != NULL) {
-        // Found the client at curr
-        Client *client_to_remove = curr;
-        prev->next_client = curr->next_client;
-
-        free(client_to_remove->buf);
-        free(client_to_remove);
-    }
-
-    return client_list;
 }
 
 /*
- * Send a message to all connected clients with a user with username <username>.
- * <client_list> is the head of the linked list client structure.
- * Returns the head of the linked list client structure in case any clients are closed.
+ * Count a change to the users that the next snapshot has to save.
  */
-Client *message_to_users(char *username, Client *client_list, char *message) {
-    Client *curr_client = client_list;
-
-    while (curr_client != NULL) {
-        if (curr_client->user != NULL
-            && strcmp(curr_client->user->name, username) == 0
-            && message_client(curr_client, message) == -1) {
-            // We tried to send the message but the Client disconnected. Before we remove it, go to the next client.
-            int disconnected_client_fd = curr_client->sock_fd;
-            curr_client = curr_client->next_client;
-            client_list = remove_client(disconnected_client_fd, client_list);
-        } else {
-            curr_client = curr_client->next_client;
-        }
+void record_change() {
+    if (__atomic_fetch_add(&unsaved_changes, 1, __ATOMIC_RELAXED) == 0 && snapshot_path != NULL) {
+        // Worker 0 may be waiting with no snapshot due.
+        wake_snapshot_worker();
     }
-
-    return client_list;
 }
 
 /*
- * Adds or retrieves the user with username <username> to the client specified by <client_fd>
+ * Adds or retrieves the user with username <username> to <client>
  * If no user exists, creates a new user with <username>.
  * If a user exists with the username <username>, adds this user to the client.
  */
-void add_user_to_client(char *username, int client_fd, Client *client_list, User **user_list_ptr) {
-    Client *client = find_client_by_sockfd(client_fd, client_list);
-
+void add_user_to_client(char *username, Client *client, ClientTable *clients, User **user_list_ptr) {
     // Check if the username is within the limits
     if (strlen(username) >= MAX_NAME) {
         username[MAX_NAME - 1] = '\0';
@@ -192,131 +124,100 @@ void add_user_to_client(char *username, int client_fd, Client *client_list, User
         char truncated_msg[BUF_SIZE];
         snprintf(truncated_msg, BUF_SIZE, "Username too long, truncated to %d characters.\n", MAX_NAME - 1);
         if (message_client(client, truncated_msg) == -1) {
-            remove_client(client->sock_fd, client_list);
+            close_client(client, clients);
             return;
         }
     }
 
     // Find the user from the list if it already exists.
+    lock_users(0);
     User *user = find_user(username, *user_list_ptr);
+    unlock_users();
 
     // Create the User with the username <username> if it doesn't exist
     if (user == NULL) {
-        if (create_user(username, user_list_ptr) != 0) {
-            // We should never get here if the preconditions are respected.
-            fprintf(stderr, "Create user failed\n");
-            return;
-        }
+        // Another worker may have created the user before the list was locked to change it.
+        lock_users(1);
+        int created = 0;
         user = find_user(username, *user_list_ptr);
+        if (user == NULL) {
+            if (create_user(username, user_list_ptr) != 0) {
+                // We should never get here if the preconditions are respected.
+                unlock_users();
+                fprintf(stderr, "Create user failed\n");
+                return;
+            }
+            user = find_user(username, *user_list_ptr);
+            if (journal != NULL) {
+                journal_create_user(journal, user->name);
+            }
+            created = 1;
+        }
+        unlock_users();
+        if (created) {
+            record_change();
+        }
 
 		// Send a welcome message
-		if (message_client(client, "Welcome!\n") == -1) {
-            remove_client(client->sock_fd, client_list);
+		if (message_client(client, created ? "Welcome!\n" : "Welcome Back!\n") == -1) {
+            close_client(client, clients);
             return;
         }
 
     } else {
 		// The user exists so all we have to do is print the "Welcome back" message
         if (message_client(client, "Welcome Back!\n") == -1) {
-            remove_client(client->sock_fd, client_list);
+            close_client(client, clients);
             return;
         }
 	}
 
     // Inform the client that they can write user commands now
     if (message_client(client, "You may enter user commands now:\n") == -1) {
-        remove_client(client->sock_fd, client_list);
+        close_client(client, clients);
         return;
     }
 
-    client->user = user;
+    attach_session(client, user);
 }
 
 /*
- * Adds a client to the tail of the linked list structure with no user (this function
- * is used for new connections before they have sent their username)
- * Returns the first client in the list
+ * Add a client for the newly accepted socket <client_fd> to <clients> and ask it for its username.
+ * Return the new client, which may already be marked closed if it disconnected immediately.
  */
-Client *add_client(Client *client_list, int client_fd) {
-    // Create the Client struct
-    Client *new_client = malloc(sizeof(Client));
-    if (new_client == NULL) {
-        perror("Client struct malloc");
-        exit(1);
-    }
-
-    // Initialize the struct values
-    new_client->sock_fd = client_fd;
-    new_client->buf = malloc(BUF_SIZE);
-    if (new_client->buf == NULL) {
-        perror("new client malloc");
-        exit(1);
-    }
-    new_client->buf[0] = '\0';  // Ensure the buffer starts null-terminated.
-    new_client->in_buf = 0;
-    new_client->user = NULL;
-    new_client->next_client = NULL;
+Client *new_connection(int client_fd, ClientTable *clients) {
+    // Add a new empty client to the client table.
+    Client *new_client = add_client(clients, client_fd);
 
-    // If the list is empty, new_client is the head.
-    if (client_list == NULL) {
-        return new_client;
+    // Send the initial instruction message to ask for their username to the client
+    if (message_client(new_client, "Please enter your username:\n")) {
+        // The client disconnected.
+        close_client(new_client, clients);
     }
 
-    // Insert the new client at the tail of the linked list.
-    Client *curr_client = client_list;
-    while (curr_client->next_client != NULL) {
-        curr_client = curr_client->next_client;
-    }
-    curr_client->next_client = new_client;
-    return client_list;
+    return new_client;
 }
 
-
 /*
  * Accept a connection. Note that a new file descriptor is created for
  * communication with the client. The initial socket descriptor is used
  * to accept connections, but the new socket is used to communicate.
- * <client_fd> is set to the file descriptor of the new client or -1 if the client disconnected immediately
- * Return the head of the client list with the new client in it.
+ * <fd> must be non-blocking. The new socket is non-blocking as well.
+ * Return the Client for the new connection or NULL if there was no pending connection.
+ * The new client may already be marked closed if it disconnected immediately.
  */
-Client *accept_connection(int fd, Client *client_list, int *client_fd) {
-    *client_fd = accept(fd, NULL, NULL);
-    if (*client_fd < 0) {
+Client *accept_connection(int fd, ClientTable *clients) {
+    int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK);
+    if (client_fd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+            // No more pending connections (or the pending one went away before we accepted it).
+            return NULL;
+        }
         perror("server: accept");
         close(fd);
         exit(1);
     }
-
-    // Add a new empty client to the linked list structure.
-    client_list = add_client(client_list, *client_fd);
-
-    // Send the initial instruction message to ask for their username to the client
-    if (message_client(find_client_by_sockfd(*client_fd, client_list), "Please enter your username:\n")) {
-        // The client disconnected.
-        remove_client(*client_fd, client_list);
-        return client_list;
-    }
-
-    return client_list;
-}
-
-/*
- * Search the first n characters of buf for a network newline (\r\n).
- * Return one plus the index of the '\n' of the first network newline,
- * or -1 if no network newline is found. The return value is the index into buf
- * where the current line ends.
- */
-int find_network_newline(const char *buf, int n) {
-    for (int i = 0; i < n; i++) {
-        // The first network newline will be a \n preceded by a \r
-        if (buf[i] == '\n') {
-            if (i > 0 && buf[i - 1] == '\r') {
-                // Found the network newline
-                return i + 1;
-            }
-        }
-    }
-    return -1;
+    return new_connection(client_fd, clients);
 }
 
 /*
@@ -336,32 +237,11 @@ char *alloc_str(char *msg) {
 	return return_msg;
 }
 
-/*
- * Tokenize the string stored in cmd.
- * Return the number of tokens, and store the tokens in cmd_argv.
- * If there are too many arguments, return -1.
- */
-int tokenize(char *cmd, char **cmd_argv) {
-	int cmd_argc = 0;
-	char *next_token = strtok(cmd, DELIM);
-	while (next_token != NULL) {
-		if (cmd_argc >= INPUT_ARG_MAX_NUM - 1) {
-			// There are too many arguments.
-			cmd_argc = 0;
-			return -1;
-			break;
-		}
-		cmd_argv[cmd_argc] = next_token;
-		cmd_argc++;
-		next_token = strtok(NULL, DELIM);
-	}
-
-	return cmd_argc;
-}
-
 /*
  * Read and process commands
- * <first_user> is the user who sent the command (the first user for certain operations like post)
+ * <line> is the <len> byte command line, without its network newline.
+ * <client> is the connection that sent the command. Its user is the first user for certain operations like post.
+ * Responses that are sent straight to the client (a profile or the user list) are not returned in <return_msg>.
  * <user_list_ptr> is a list of pointers to users.
  * <return_msg> is set to point to a null_terminated string with the message associated or an empty string
  * if there is no message. (The returned string is dynamically allocated if it isn't empty).
@@ -370,214 +250,490 @@ int tokenize(char *cmd, char **cmd_argv) {
  *          -1 for an error
  *          0 otherwise
  */
-int process_args(int cmd_argc, char **cmd_argv, User *first_user, User **user_list_ptr, Client *client_list, char **return_msg) {
+int process_args(const char *line, size_t len, Client *client, User **user_list_ptr, ClientTable *clients, char **return_msg) {
 	User *user_list = *user_list_ptr;
-
-	if (cmd_argc <= 0) {
+	User *first_user = client->user;
+	Tokenizer tokenizer;
+	Slice cmd;
+	Slice args[3];
+	char name[MAX_NAME + 1];
+
+	tokenizer_init(&tokenizer, line, len);
+	if (!next_token(&tokenizer, &cmd)) {
 		return 0;
-	} else if (strcmp(cmd_argv[0], "quit") == 0 && cmd_argc == 1) {
+	}
+
+	switch (lookup_command(cmd)) {
+	case CMD_QUIT:
+		if (exact_args(&tokenizer, args, 0) == -1) {
+			break;
+		}
 		return -2;
-	} else if (strcmp(cmd_argv[0], "list_users") == 0 && cmd_argc == 1) {
-        *return_msg = list_users(user_list);
-	} else if (strcmp(cmd_argv[0], "make_friends") == 0 && cmd_argc == 2) {
+	case CMD_LIST_USERS:
+		if (exact_args(&tokenizer, args, 0) == -1) {
+			break;
+		}
+        // Send the listing create_user maintains without copying it into a return message.
+        if (message_client(client, cached_user_list(user_list)) == -1) {
+            close_client(client, clients);
+        }
+		return 0;
+	case CMD_MAKE_FRIENDS: {
+		if (exact_args(&tokenizer, args, 1) == -1) {
+			break;
+		}
+		copy_name(args[0], name);
         // Setup the messages notifying the users in the success place.
         // We cannot place this in the switch statement as the case is a label
         // so we set it up here for use in case 0.
         char new_friend_author_msg[BUF_SIZE];
-        snprintf(new_friend_author_msg, BUF_SIZE, "You are now friends with %s!\n", cmd_argv[1]);
+        snprintf(new_friend_author_msg, BUF_SIZE, "You are now friends with %s!\n", name);
         char new_friend_target_msg[BUF_SIZE];
         snprintf(new_friend_target_msg, BUF_SIZE, "You are now friends with %s!\n", first_user->name);
-		switch (make_friends(first_user->name, cmd_argv[1], user_list)) {
+        // Both users are locked while they change, and the change is journaled before another
+        // worker can change them again, so the journal has the changes to each user in order.
+        User *target = find_user(name, user_list);
+        lock_user_pair(first_user, target);
+        int result = make_friends(first_user->name, name, user_list);
+        if (result == 0 && journal != NULL) {
+            journal_make_friends(journal, first_user->name, name);
+        }
+        unlock_user_pair(first_user, target);
+		switch (result) {
             case 0:
+                record_change();
                 // Success, notify the new friend if they are online
-                message_to_users(cmd_argv[1], client_list, new_friend_target_msg);
-                message_to_users(first_user->name, client_list, new_friend_author_msg);
-                break;
+                message_to_user(target, clients, new_friend_target_msg);
+                message_to_user(first_user, clients, new_friend_author_msg);
+                return 0;
 			case 1:
 				*return_msg = alloc_str("users are already friends\n");
 				return -1;
-				break;
 			case 2:
 				*return_msg = alloc_str("at least one user you entered has the max number of friends\n");
 				return -1;
-				break;
 			case 3:
 				*return_msg = alloc_str("you must enter two different users\n");
 				return -1;
-				break;
-			case 4:
+			default:
 				*return_msg = alloc_str("at least one user you entered does not exist\n");
 				return -1;
-				break;
 		}
-	} else if (strcmp(cmd_argv[0], "post") == 0 && cmd_argc >= 3) {
-		// first determine how long a string we need
-		int space_needed = 0;
-		for (int i = 2; i < cmd_argc; i++) {
-			space_needed += strlen(cmd_argv[i]) + 1;
-		}
-
-		// allocate the space
-		char *contents = malloc(space_needed);
-		if (contents == NULL) {
-			perror("malloc");
-			exit(1);
-		}
-
-		// copy in the bits to make a single string
-		strcpy(contents, cmd_argv[2]);
-		for (int i = 3; i < cmd_argc; i++) {
-			strcat(contents, " ");
-			strcat(contents, cmd_argv[i]);
+	}
+	case CMD_POST: {
+		// The contents are the rest of the line, with its whitespace as the user typed it.
+		Slice contents;
+		if (!next_token(&tokenizer, &args[0]) || (contents = rest_of_line(&tokenizer)).len == 0) {
+			break;
 		}
+		copy_name(args[0], name);
 
 		User *author = first_user;
-		User *target = find_user(cmd_argv[1], user_list);
+		User *target = find_user(name, user_list);
 
-        // Setup the message notifying the other user of the post's contents
-        // We cannot place this in the switch statement as the case is a label
-        // so we set it up here for use in case 0.
-        char post_msg[BUF_SIZE];
-        snprintf(post_msg, BUF_SIZE, "Message from %s: %s\n", author->name, contents);
-		switch (make_post(author, target, contents)) {
-            case 0:
+		lock_user_pair(author, target);
+		int result = make_post_copy(author, target, contents.data, contents.len);
+		if (result == 0 && journal != NULL) {
+			journal_make_post(journal, target->name, target->first_post);
+		}
+		unlock_user_pair(author, target);
+		switch (result) {
+            case 0: {
+                record_change();
                 // Success, notify the target of the message if they are online
-                message_to_users(target->name, client_list, post_msg);
-                break;
+                // Lines can be longer than BUF_SIZE, so the message is built to fit the post.
+                StrBuf post_msg = {NULL, 0, 0};
+                append_cstr(&post_msg, "Message from ");
+                append_cstr(&post_msg, author->name);
+                append_str(&post_msg, ": ", 2);
+                append_str(&post_msg, contents.data, contents.len);
+                append_str(&post_msg, "\n", 1);
+                message_to_user(target, clients, post_msg.data);
+                free(post_msg.data);
+                return 0;
+            }
 			case 1:
-				// We no longer need the contents so free it on error.
-				free(contents);
 				*return_msg = alloc_str("the users are not friends\n");
 				return -1;
-				break;
-			case 2:
-				// We no longer need the contents so free it on error.
-				free(contents);
+			default:
 				*return_msg = alloc_str("at least one user you entered does not exist\n");
 				return -1;
-				break;
 		}
-	} else if (strcmp(cmd_argv[0], "profile") == 0 && cmd_argc == 2) {
-		User *user = find_user(cmd_argv[1], user_list);
+	}
+	case CMD_PROFILE: {
+		// An offset and a limit, both optional, ask for one page of the user's posts.
+		unsigned int offset = 0;
+		unsigned int limit = DEFAULT_PAGE_POSTS;
+		if (!next_token(&tokenizer, &args[0])) {
+			break;
+		}
+		int paged = next_token(&tokenizer, &args[1]);
+		if (paged && (parse_number(args[1], &offset) == -1
+		        || (next_token(&tokenizer, &args[2]) && parse_number(args[2], &limit) == -1)
+		        || exact_args(&tokenizer, args, 0) == -1)) {
+			break;
+		}
+		copy_name(args[0], name);
+		User *user = find_user(name, user_list);
 		if (user == NULL) {
 			*return_msg = alloc_str("user not found\n");
 			return -1;
-		} else {
-			*return_msg = print_user(user);
 		}
-	} else {
-		*return_msg = alloc_str("Incorrect syntax\n");
-		return -1;
+		if (paged) {
+			// A page is found through the user's post index, so it is rendered here rather than cached.
+			StrBuf page = {NULL, 0, 0};
+			lock_user(user);
+			render_profile_page(user, offset, limit, &page);
+			unlock_user(user);
+			int result = message_client(client, page.data);
+			free(page.data);
+			if (result == -1) {
+				close_client(client, clients);
+			}
+			return 0;
+		}
+		// Send the cached profile without copying it into a return message. With a render pool,
+		// a profile that has to be rendered is rendered from a view of the user by a render thread.
+		ProfileView view;
+		lock_user(user);
+		const char *profile = render_threads > 0 ? cached_profile_or_view(user, &view) : cached_profile(user);
+		int result = profile == NULL ? 0 : message_client(client, profile);
+		unlock_user(user);
+		if (profile == NULL) {
+			render_profile_for(&view, client);
+		} else if (result == -1) {
+			close_client(client, clients);
+		}
+		return 0;
+	}
+	case CMD_POSTS: {
+		unsigned int since;
+		if (exact_args(&tokenizer, args, 3) == -1 || args[1].len != 5 || memcmp(args[1].data, "since", 5) != 0
+		        || parse_number(args[2], &since) == -1) {
+			break;
+		}
+		copy_name(args[0], name);
+		User *user = find_user(name, user_list);
+		if (user == NULL) {
+			*return_msg = alloc_str("user not found\n");
+			return -1;
+		}
+		StrBuf posts = {NULL, 0, 0};
+		lock_user(user);
+		render_posts_since(user, since, &posts);
+		unlock_user(user);
+		int result = message_client(client, posts.data);
+		free(posts.data);
+		if (result == -1) {
+			close_client(client, clients);
+		}
+		return 0;
+	}
+	case CMD_SUGGEST: {
+		// The number of suggestions is optional.
+		unsigned int max_suggestions = DEFAULT_SUGGESTIONS;
+		if (next_token(&tokenizer, &args[0])
+		        && (parse_number(args[0], &max_suggestions) == -1 || exact_args(&tokenizer, args, 0) == -1)) {
+			break;
+		}
+		// Copy the user's friends, then count each friend's friends holding only that friend's lock,
+		// so at most one user is locked at a time. Friends are only ever added, so the copy stays valid.
+		lock_user(first_user);
+		unsigned int num_friends = first_user->friends.count;
+		User **friends = malloc((num_friends > 0 ? num_friends : 1) * sizeof(User *));
+		if (friends == NULL) {
+			perror("suggest malloc");
+			exit(1);
+		}
+		memcpy(friends, first_user->friends.members, num_friends * sizeof(User *));
+		unlock_user(first_user);
+		for (unsigned int i = 0; i < num_friends; i++) {
+			lock_user(friends[i]);
+			count_mutual_friends(&mutual_counts, friends[i]);
+			unlock_user(friends[i]);
+		}
+		StrBuf suggestions = {NULL, 0, 0};
+		render_suggestions(&mutual_counts, first_user, friends, num_friends, max_suggestions, &suggestions);
+		free(friends);
+		int result = message_client(client, suggestions.data);
+		free(suggestions.data);
+		if (result == -1) {
+			close_client(client, clients);
+		}
+		return 0;
+	}
+	case CMD_FEED: {
+		// The number of posts is optional.
+		unsigned int max_posts = DEFAULT_FEED_POSTS;
+		if (next_token(&tokenizer, &args[0])
+		        && (parse_number(args[0], &max_posts) == -1 || exact_args(&tokenizer, args, 0) == -1)) {
+			break;
+		}
+		// Only the user's friends have to stay the same; posts on their walls are published atomically.
+		StrBuf feed = {NULL, 0, 0};
+		lock_user(first_user);
+		render_feed(first_user, max_posts, &feed);
+		unlock_user(first_user);
+		int result = message_client(client, feed.data);
+		free(feed.data);
+		if (result == -1) {
+			close_client(client, clients);
+		}
+		return 0;
+	}
+	case CMD_STATS: {
+		if (exact_args(&tokenizer, args, 0) == -1) {
+			break;
+		}
+		unsigned long hits, misses;
+		profile_cache_stats(&hits, &misses);
+		char stats_msg[2 * BUF_SIZE];
+		int len = 0;
+		if (worker_ring != NULL) {
+			// Comes first so a client reading up to the profile cache line has already received it.
+			len += snprintf(stats_msg, sizeof(stats_msg), "Event loop: io_uring, %lu system calls\n",
+			                worker_ring->num_enters);
+		}
+		len += snprintf(&stats_msg[len], sizeof(stats_msg) - len, "Profile cache: %lu hits, %lu misses\n", hits, misses);
+		if (render_threads > 0) {
+			len += snprintf(&stats_msg[len], sizeof(stats_msg) - len, "Render pool: %d threads, %lu profiles queued\n",
+			                render_threads, render_queue_length());
+		}
+		if (snapshot_path != NULL) {
+			len += snprintf(&stats_msg[len], sizeof(stats_msg) - len,
+			                "Snapshots: %lu saved, %lu failed, %lu unsaved changes%s\n",
+			                background_save.num_saved, background_save.num_failed,
+			                __atomic_load_n(&unsaved_changes, __ATOMIC_RELAXED),
+			                background_save.pid != 0 ? ", saving now" : "");
+		}
+		if (background_save.num_saved + background_save.num_failed > 0) {
+			snprintf(&stats_msg[len], sizeof(stats_msg) - len,
+			         "Last snapshot: %s in %.3f ms, server paused %.3f ms to fork, %ld pages copied on write\n",
+			         background_save.last.status == 0 ? "saved" : "failed", background_save.last.duration_ns / 1e6,
+			         background_save.fork_ns / 1e6, background_save.last.cow_pages);
+		}
+		*return_msg = alloc_str(stats_msg);
+		return 0;
+	}
+	case CMD_SAVE:
+		if (exact_args(&tokenizer, args, 0) == -1) {
+			break;
+		}
+		if (snapshot_path == NULL) {
+			*return_msg = alloc_str("snapshots are disabled\n");
+			return -1;
+		} else if (background_save.pid != 0 || __atomic_exchange_n(&save_requested, 1, __ATOMIC_RELAXED)) {
+			*return_msg = alloc_str("a snapshot is already being saved\n");
+			return -1;
+		}
+		// The snapshot is started by worker 0 at the end of its event loop pass.
+		wake_snapshot_worker();
+		*return_msg = alloc_str("Saving a snapshot in the background\n");
+		return 0;
+	default:
+		break;
 	}
 
-	// No error occurred, no message to print.
-	return 0;
+	// The command is unknown or has the wrong number of arguments.
+	*return_msg = alloc_str("Incorrect syntax\n");
+	return -1;
 }
 
 /*
- * Read a message from the client with sock_fd <fd> and set the username or process the arguments.
- * This client should be ready to be read (checked with select before calling this function).
- * Return the fd if it has been closed or 0 otherwise.
+ * Set the username or process the command of every complete line in the input buffer of <client>.
+ * Return the client's fd if it has been closed or 0 otherwise.
  *
  * There are two different types of input that we could
  * receive: a username, or a command. If we have not yet received
  * the username, then we should copy buf to username.  Otherwise, the
  * input will be a command to process.
  */
-int read_from(int fd, Client *client_list, User **user_list) {
-    // Ensure buffer starts null terminated
-    Client *client = find_client_by_sockfd(fd, client_list);
-
-    // There may still be stuff in the buffer so set the room and after pointer variables appropriately
-    int room = BUF_SIZE - client->in_buf;
-    char *after = &(client->buf[client->in_buf]);
-
-    int num_read;
-    num_read = read(fd, after, room);
-    if (num_read == 0) {
-        // The client disconnected
-        printf("[Server] Discovered client %d is closed\n", client->sock_fd);
-        return client->sock_fd;
-    }
-
-    // Update inbuf based on how many bytes were just read
-    client->in_buf += num_read;
-    room -= num_read;
-
-    int where;
-
-    // Use a loop to read continuously until we get a network newline. The loop structure handles having multiple
-    // lines in the buffer.
-    // Update where to be the location after this network newline and process the input(s) accordingly.
-    while ((where = find_network_newline(client->buf, client->in_buf)) > 0) {
-        // Where is now the index into buf immediately after the first network newline.
-        // Null terminate the buffer at the carriage return part of the network newline.
-        // (where is guaranteed to be >= 2 as a network newline is two characters).
-        client->buf[where - 2] = '\0';
-
-        // Check if this is a username or a command
-        if (client->user->name == NULL) {
-            if (num_read == 0) {
-                // Client was closed
+int process_lines(Client *client, ClientTable *clients, User **user_list) {
+    int fd = client->sock_fd;
+
+    // Each search for a network newline starts where the last one stopped, so no byte is scanned twice.
+    char *line;
+    size_t len;
+    int result;
+    while ((result = next_line(client, &line, &len)) != 0) {
+        if (client->closed) {
+            // A command closed the client (it fell too far behind), so its other lines are dropped
+            // rather than changing the users for a connection that is gone.
+            return fd;
+        }
+        if (result == -1) {
+            char too_long_msg[BUF_SIZE];
+            snprintf(too_long_msg, BUF_SIZE, "Line too long, the limit is %zu bytes\n", max_line_len);
+            if (message_client(client, too_long_msg) == -1) {
                 return fd;
             }
+            continue;
+        }
 
+        // Check if this is a username or a command
+        if (client->user == NULL) {
             // This call either identifies the user from existing users or adds a new user to the user_list
-            add_user_to_client(client->buf, client->sock_fd, client_list, user_list);
+            add_user_to_client(line, client, clients, user_list);
+            if (client->closed) {
+                return fd;
+            }
 
             // Server message acknowledging new connection
             printf("[Server] User at %d now has username %s\n", fd, client->user->name);
         } else {
             // The message we send back to the client.
             char *return_msg = "";
-            char *cmd_argv[INPUT_ARG_MAX_NUM];
-            int cmd_argc = tokenize(client->buf, cmd_argv);
 
-            if (process_args(cmd_argc, cmd_argv, client->user, user_list, client_list, &return_msg) == -2) {
+            // Commands read the list of users, which only changes while it is locked exclusively.
+            lock_users(0);
+            int status = process_args(line, len, client, user_list, clients, &return_msg);
+            unlock_users();
+            if (status == -2) {
                 // The user has quit by sending the quit command.
                 printf("[Server] User at %d has quit using quit command\n", fd);
                 return fd;
-            } else {
-                // The command was processed. Check if there is a return message.
-                if (cmd_argc < 0) {
-                    // In the case that there were too many arguments in tokenize, process_args will return 0
-                    // without processing any of the commands because cmd_argc would have been set to -1.
-                    // This warrants this error return message to the user.
-                    return_msg = alloc_str("Too many arguments!\n");
-                }
-
-                if (return_msg[0] != '\0') {
-                    // Send the non-empty return message back to the client.
-                    if (message_client(client, return_msg) == -1) {
-                        // Free the return message as we have sent it.
-                        free(return_msg);
-                        return fd;
-                    }
+            } else if (return_msg[0] != '\0') {
+                // Send the non-empty return message back to the client.
+                if (message_client(client, return_msg) == -1) {
                     // Free the return message as we have sent it.
                     free(return_msg);
+                    return fd;
                 }
+                // Free the return message as we have sent it.
+                free(return_msg);
             }
 
             // Server message to acknowledge that we processed a command from the user.
             printf("[Server] Processed command from User %d\n", fd);
         }
+    }
+    return 0;
+}
+
+/*
+ * Read all available input from <client> and set the username or process the arguments.
+ * The client's socket is read until it would block, as required by edge-triggered readiness.
+ * Return the client's fd if it has been closed or 0 otherwise.
+ */
+int read_from(Client *client, ClientTable *clients, User **user_list) {
+    int fd = client->sock_fd;
 
-        // The input has been processed, now update the unprocessed contents of the buffer to the
-        // beginning so it can be processed
-        memmove(client->buf, &client->buf[where], BUF_SIZE - where);
-        client->in_buf = client->in_buf - where;
+    while (1) {
+        // Receive into the free space after the bytes still waiting in the buffer.
+        size_t room;
+        char *after = reserve_input(client, &room);
+
+        ssize_t num_read = recv(fd, after, room, MSG_DONTWAIT);
+        if (num_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Everything the client sent so far has been read.
+                return 0;
+            }
+            perror("server: read");
+            return fd;
+        } else if (num_read == 0) {
+            // The client disconnected
+            printf("[Server] Discovered client %d is closed\n", fd);
+            return fd;
+        }
+        client->in_end += num_read;
+
+        // Process every complete line in the buffer.
+        if (process_lines(client, clients, user_list) > 0) {
+            return fd;
+        }
+    }
+}
+
+/*
+ * Return the number of milliseconds until the next snapshot is due, 0 if it is overdue,
+ * or -1 if no snapshot is waiting to be taken (or one is already being saved).
+ */
+int snapshot_timeout() {
+    if (snapshot_path == NULL || background_save.pid != 0) {
+        return -1;
+    } else if (__atomic_load_n(&save_requested, __ATOMIC_RELAXED)) {
+        return 0;
+    } else if (__atomic_load_n(&unsaved_changes, __ATOMIC_RELAXED) == 0) {
+        return -1;
     }
+    time_t now = time(NULL);
+    return now >= next_snapshot ? 0 : (next_snapshot - now) * 1000;
+}
 
-    // Now that every full line in the buffer has been processed, update after and room
-    // for any more partial reads.
-    after = &client->buf[client->in_buf];
-    room = BUF_SIZE - client->in_buf;
 
-    // No more reads from the client.
-    return 0;
+/*
+ * Snapshot the list of users starting at <user_list> if a save was requested, or if there are
+ * unsaved changes and the snapshot interval has passed. The journal is committed first so the
+ * snapshot records exactly which journal records it reflects.
+ * The snapshot is written by a forked child; if fork fails it is written here instead.
+ * The users are locked exclusively while the child is forked, so no worker is in the middle of
+ * changing them. Only worker 0 takes snapshots.
+ * Return 1 if a child was started, so its background_save.result_fd needs to be watched, or 0 otherwise.
+ */
+int maybe_snapshot(User **user_list) {
+    if (snapshot_timeout() != 0) {
+        return 0;
+    }
+    __atomic_store_n(&save_requested, 0, __ATOMIC_RELAXED);
+    next_snapshot = time(NULL) + snapshot_interval;
+
+    lock_users(1);
+    off_t journal_offset = 0;
+    if (journal != NULL) {
+        journal_commit(journal);
+        journal_offset = journal->size;
+    }
+    int started = 0;
+    if (start_background_save(&background_save, snapshot_path, *user_list, journal_offset) == 0) {
+        changes_in_save = unsaved_changes;
+        printf("[Server] Saving a snapshot of %lu changes in the background (fork took %.3f ms)\n",
+               changes_in_save, background_save.fork_ns / 1e6);
+        started = 1;
+    } else if (save_snapshot(snapshot_path, *user_list, journal_offset) == 0) {
+        printf("[Server] Saved a snapshot of %lu changes to %s\n", unsaved_changes, snapshot_path);
+        unsaved_changes = 0;
+    }
+    // On failure the changes stay unsaved and the snapshot is retried after another interval.
+    unlock_users();
+    return started;
 }
 
-int main() {
+
+/*
+ * Collect the result of the snapshot being saved in the background once its child reports.
+ */
+void finish_snapshot() {
+    lock_users(1);
+    int status = finish_background_save(&background_save);
+    unlock_users();
+    if (status == 0) {
+        // Changes made while the child was saving are not in the snapshot and stay unsaved.
+        __atomic_fetch_sub(&unsaved_changes, changes_in_save, __ATOMIC_RELAXED);
+        printf("[Server] Saved a snapshot to %s in %.3f ms, %ld pages copied on write\n", snapshot_path,
+               background_save.last.duration_ns / 1e6, background_save.last.cow_pages);
+    } else {
+        fprintf(stderr, "[Server] Failed to save a snapshot to %s\n", snapshot_path);
+    }
+}
+
+/*
+ * Write the changes made so far to the journal, if there is one. The commit function of every
+ * worker's table, so output sent before the end of a pass does not get ahead of the journal.
+ */
+void commit_journal() {
+    if (journal != NULL) {
+        journal_commit(journal);
+    }
+}
+
+/*
+ * Create a non-blocking socket listening on PORT. With <reuse_port> set, several sockets can
+ * listen on PORT at once and the kernel spreads new connections over them.
+ */
+int open_listen_socket(int reuse_port) {
     // Create the socket FD.
     int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (sock_fd < 0) {
@@ -597,6 +753,10 @@ int main() {
 	if (status == -1) {
 		perror("setsockopt -- REUSEADDR");
 	}
+	if (reuse_port && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, (const char *) &on, sizeof(on)) == -1) {
+		perror("setsockopt -- REUSEPORT");
+		exit(1);
+	}
 
     // This should always be zero. On some systems, it won't error if you
     // forget, but on others, you'll get mysterious errors. So zero it.
@@ -616,57 +776,637 @@ int main() {
         exit(1);
     }
 
-    // The client accept - message accept loop. First, we prepare to listen to multiple
-    // file descriptors by initializing a set of file descriptors.
-    int max_fd = sock_fd;
-    fd_set all_fds;
-    FD_ZERO(&all_fds);
-    FD_SET(sock_fd, &all_fds);
+    // The listening socket is non-blocking so that every pending connection can be accepted
+    // in a loop until accept reports there are none left.
+    if (fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("server: fcntl");
+        close(sock_fd);
+        exit(1);
+    }
+    return sock_fd;
+}
 
-    // Setup the list of clients
-    Client *client_list = NULL;
-    // Setup the list of users
-    User *user_list = NULL;
+#ifdef USE_SELECT
+/*
+ * Run the event loop of <worker> forever.
+ * The select fallback. The set of file descriptors is rebuilt from the client list on every
+ * pass, so it is limited to FD_SETSIZE descriptors and costs O(number of clients) per wakeup.
+ * It only runs a single worker.
+ */
+void *run_worker(void *arg) {
+    Worker *worker = arg;
+    int sock_fd = worker->listen_fd;
+    ClientTable *clients = &worker->clients;
+    User **user_list = worker->user_list;
 
     while (1) {
-        // select updates the fd_set it receives, so we always use a copy and retain the original.
-        fd_set listen_fds = all_fds;
-        if (select(max_fd + 1, &listen_fds, NULL, NULL, NULL) == -1) {
+        int max_fd = sock_fd;
+        fd_set listen_fds;
+        fd_set write_fds;
+        FD_ZERO(&listen_fds);
+        FD_ZERO(&write_fds);
+        FD_SET(sock_fd, &listen_fds);
+        for (Client *curr_client = clients->head; curr_client != NULL; curr_client = curr_client->next_client) {
+            FD_SET(curr_client->sock_fd, &listen_fds);
+            if (curr_client->out_start < curr_client->out_end) {
+                // Only wait for the socket to become writable if there is output waiting for it.
+                FD_SET(curr_client->sock_fd, &write_fds);
+            }
+            if (curr_client->sock_fd > max_fd) {
+                max_fd = curr_client->sock_fd;
+            }
+        }
+        if (clients->wake_fd != -1) {
+            FD_SET(clients->wake_fd, &listen_fds);
+            if (clients->wake_fd > max_fd) {
+                max_fd = clients->wake_fd;
+            }
+        }
+        if (background_save.pid != 0) {
+            FD_SET(background_save.result_fd, &listen_fds);
+            if (background_save.result_fd > max_fd) {
+                max_fd = background_save.result_fd;
+            }
+        }
+
+        // Wake up in time for the next snapshot.
+        struct timeval timeout;
+        int timeout_ms = snapshot_timeout();
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_usec = 0;
+
+        if (select(max_fd + 1, &listen_fds, &write_fds, NULL, timeout_ms == -1 ? NULL : &timeout) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
             perror("server: select");
             exit(1);
         }
 
-        // Is it the original socket? Create a new connection ...
+        // Check the clients for if they have writes or reads available.
+        for (Client *curr_client = clients->head; curr_client != NULL; curr_client = curr_client->next_client) {
+            if (!curr_client->closed && FD_ISSET(curr_client->sock_fd, &write_fds)) {
+                if (flush_client(curr_client) == -1) {
+                    close_client(curr_client, clients);
+                }
+            }
+            if (!curr_client->closed && FD_ISSET(curr_client->sock_fd, &listen_fds)) {
+                if (read_from(curr_client, clients, user_list) > 0) {
+                    close_client(curr_client, clients);
+                }
+            }
+        }
+
+        // Is it the original socket? Create new connections ...
         if (FD_ISSET(sock_fd, &listen_fds)) {
-            int client_fd;
-            client_list = accept_connection(sock_fd, client_list, &client_fd);
-            if (client_fd == -1) {
-                // Client closed the connection immediately
-                continue;
+            Client *new_client;
+            while ((new_client = accept_connection(sock_fd, clients)) != NULL) {
+                printf("[Server] Accepted connection\n");
+                if (new_client->sock_fd >= FD_SETSIZE) {
+                    fprintf(stderr, "[Server] Too many connections for select, dropping client %d\n",
+                            new_client->sock_fd);
+                    close_client(new_client, clients);
+                }
             }
-            if (client_fd > max_fd) {
-                max_fd = client_fd;
+        }
+
+        // Send the profiles rendered by the render pool.
+        if (clients->wake_fd != -1 && FD_ISSET(clients->wake_fd, &listen_fds)) {
+            deliver_mail(clients);
+        }
+
+        // Collect the result of a snapshot saved in the background.
+        if (background_save.pid != 0 && FD_ISSET(background_save.result_fd, &listen_fds)) {
+            finish_snapshot();
+        }
+
+        // Write the changes made during this pass to the journal together.
+        if (journal != NULL) {
+            journal_commit(journal);
+        }
+
+        // Send the responses and notifications queued during this pass, one flush per client,
+        // now that the changes they acknowledge are in the journal.
+        flush_pending_clients(clients);
+
+        // Remove the structs of every client that disconnected during this pass.
+        reap_clients(clients);
+
+        maybe_snapshot(user_list);
+    }
+    return NULL;
+}
+#else
+/*
+ * Run the event loop of <worker> forever.
+ * The epoll event loop. Every socket is registered edge-triggered, and each client's event carries a
+ * pointer to its Client so a ready event maps straight to its connection. The listening socket is
+ * registered with a NULL pointer and the worker's mailbox eventfd with a pointer to its ClientTable.
+ * Clients are registered for both reads and writes from the start; being edge-triggered, a writable
+ * event only arrives when a full socket buffer drains.
+ */
+void *run_worker(void *arg) {
+    Worker *worker = arg;
+    int sock_fd = worker->listen_fd;
+    ClientTable *clients = &worker->clients;
+    User **user_list = worker->user_list;
+    int takes_snapshots = worker == &workers[0];
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+        perror("server: epoll_create1");
+        exit(1);
+    }
+
+    struct epoll_event listen_event;
+    listen_event.events = EPOLLIN | EPOLLET;
+    listen_event.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &listen_event) == -1) {
+        perror("server: epoll_ctl");
+        exit(1);
+    }
+    if (clients->wake_fd != -1) {
+        struct epoll_event wake_event;
+        wake_event.events = EPOLLIN | EPOLLET;
+        wake_event.data.ptr = clients;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, clients->wake_fd, &wake_event) == -1) {
+            perror("server: epoll_ctl");
+            exit(1);
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        // Wake up in time for the next snapshot.
+        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, takes_snapshots ? snapshot_timeout() : -1);
+        if (num_events == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-            FD_SET(client_fd, &all_fds);
-            printf("[Server] Accepted connection\n");
-        }
-
-        // Check the clients for if they have reads available.
-        Client *curr_client = client_list;
-        while (curr_client != NULL) {
-            if (FD_ISSET(curr_client->sock_fd, &listen_fds)) {
-                // Note: never reduces max_fd
-                int client_closed = read_from(curr_client->sock_fd, client_list, &user_list);
-                if (client_closed > 0) {
-                    FD_CLR(client_closed, &all_fds);
-                    printf("[Server] Client %d disconnected\n", client_closed);
-                    // Remove the struct from the linked list of active client connections
-                    client_list = remove_client(client_closed, client_list);
+            perror("server: epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            Client *client = events[i].data.ptr;
+
+            if (events[i].data.ptr == &background_save) {
+                // The child saving a snapshot has reported.
+                finish_snapshot();
+            } else if (events[i].data.ptr == clients) {
+                // Another worker or the render pool sent messages to our clients, or a snapshot is wanted.
+                deliver_mail(clients);
+            } else if (client == NULL) {
+                // It is the original socket. Create new connections until there are none pending.
+                Client *new_client;
+                while ((new_client = accept_connection(sock_fd, clients)) != NULL) {
+                    if (!new_client->closed) {
+                        struct epoll_event client_event;
+                        client_event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                        client_event.data.ptr = new_client;
+                        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_client->sock_fd, &client_event) == -1) {
+                            perror("server: epoll_ctl");
+                            close_client(new_client, clients);
+                        } else {
+                            printf("[Server] Accepted connection\n");
+                        }
+                    }
+                }
+            } else {
+                // A client that was closed earlier in this pass is skipped; it is reaped below.
+                if (!client->closed && (events[i].events & EPOLLOUT)) {
+                    if (flush_client(client) == -1) {
+                        close_client(client, clients);
+                    }
+                }
+                if (!client->closed && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                    if (read_from(client, clients, user_list) > 0) {
+                        close_client(client, clients);
+                    }
                 }
             }
-            curr_client = curr_client->next_client;
         }
+
+        // Write the changes made during this pass to the journal together.
+        if (journal != NULL) {
+            journal_commit(journal);
+        }
+
+        // Send the responses and notifications queued during this pass, one flush per client,
+        // now that the changes they acknowledge are in the journal.
+        flush_pending_clients(clients);
+
+        // Remove the structs of every client that disconnected during this pass.
+        reap_clients(clients);
+
+        // A snapshot saved in the background reports on a pipe registered with a pointer to background_save.
+        if (takes_snapshots && maybe_snapshot(user_list)) {
+            struct epoll_event save_event;
+            save_event.events = EPOLLIN;
+            save_event.data.ptr = &background_save;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, background_save.result_fd, &save_event) == -1) {
+                perror("server: epoll_ctl");
+                exit(1);
+            }
+        }
+    }
+    return NULL;
+}
+#endif
+
+/*
+ * Queue a multishot accept on the listening socket <listen_fd>, which completes once for every
+ * new connection.
+ */
+void uring_accept(Uring *ring, int listen_fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_ACCEPT;
+}
+
+/*
+ * Queue a multishot receive on <client>'s socket, which completes once for every chunk of input
+ * with the chunk in one of the ring's provided buffers.
+ */
+void uring_recv(Uring *ring, Client *client) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->sock_fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ring->buf_group;
+    sqe->user_data = (unsigned long)client | URING_RECV;
+    client->uring_ops++;
+}
+
+/*
+ * Queue a poll for <fd> becoming readable, tagged with <tag>. A multishot poll completes every
+ * time it becomes readable; otherwise it completes once.
+ */
+void uring_poll(Uring *ring, int fd, int tag, int multishot) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = tag;
+}
+
+/*
+ * Queue a send of the unsent part of <client>'s send buffer.
+ */
+void uring_send(Uring *ring, Client *client) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = client->sock_fd;
+    sqe->addr = (unsigned long)&client->send_buf[client->send_start];
+    sqe->len = client->send_end - client->send_start;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long)client | URING_SEND;
+    client->uring_ops++;
+}
+
+/*
+ * The send_queued function of a table run by the io_uring event loop: queue a send of everything
+ * in <client>'s output queue unless a send is already in flight, in which case the queue is sent
+ * when that one completes. The queue is swapped with the send buffer so output can keep being
+ * queued while the kernel reads the buffer. Every send queued during a pass is submitted together.
+ * Return 0.
+ */
+int uring_send_queued(Client *client) {
+    if (client->send_start < client->send_end || client->out_start == client->out_end) {
+        return 0;
+    }
+    char *send_buf = client->send_buf;
+    size_t send_cap = client->send_cap;
+    client->send_buf = client->out_buf;
+    client->send_cap = client->out_cap;
+    client->send_start = client->out_start;
+    client->send_end = client->out_end;
+    client->out_buf = send_buf;
+    client->out_cap = send_cap;
+    client->out_start = 0;
+    client->out_end = 0;
+    client->out_offered = 0;
+    uring_send(worker_ring, client);
+    return 0;
+}
+
+/*
+ * Add the <len> bytes of input at <data> to the input buffer of <client> and process every
+ * complete line, a buffer at a time so a chunk longer than the input buffer still fits.
+ * Return the client's fd if it has been closed or 0 otherwise.
+ */
+int receive_input(Client *client, const char *data, size_t len, ClientTable *clients, User **user_list) {
+    while (len > 0) {
+        size_t room;
+        char *after = reserve_input(client, &room);
+        size_t num_copied = len < room ? len : room;
+        memcpy(after, data, num_copied);
+        client->in_end += num_copied;
+        data += num_copied;
+        len -= num_copied;
+        if (process_lines(client, clients, user_list) > 0) {
+            return client->sock_fd;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Handle the completion of a receive on <client>: <res> is the number of bytes received into
+ * the provided buffer named in <flags>, 0 if the client disconnected, or a negative errno.
+ */
+void uring_received(Uring *ring, Client *client, int res, unsigned flags, ClientTable *clients, User **user_list) {
+    int more = flags & IORING_CQE_F_MORE;
+    if (!more) {
+        client->uring_ops--;
+    }
+    int open = client->sock_fd != -1 && !client->closed;
+    if (res > 0) {
+        unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (open && receive_input(client, uring_buffer(ring, id), res, clients, user_list) > 0) {
+            close_client(client, clients);
+        }
+        uring_recycle_buffer(ring, id);
+    } else if (open && res != -ENOBUFS) {
+        // Running out of buffers only ends the receive, which is queued again below, but
+        // anything else means the client disconnected.
+        printf("[Server] Discovered client %d is closed\n", client->sock_fd);
+        close_client(client, clients);
+    }
+    if (!more && client->sock_fd != -1 && !client->closed) {
+        uring_recv(ring, client);
+    }
+}
+
+/*
+ * Handle the completion of a send to <client>: <res> is the number of bytes sent or a negative errno.
+ */
+void uring_sent(Uring *ring, Client *client, int res, ClientTable *clients) {
+    client->uring_ops--;
+    if (client->sock_fd == -1 || client->closed) {
+        return;
+    } else if (res < 0) {
+        // The client disconnected.
+        close_client(client, clients);
+        return;
+    }
+    client->send_start += res;
+    if (client->send_start < client->send_end) {
+        uring_send(ring, client);
+    } else {
+        // Start sending what was queued while this send was in flight.
+        client->send_start = 0;
+        client->send_end = 0;
+        uring_send_queued(client);
+    }
+}
+
+/*
+ * Run the event loop of <worker> forever with io_uring instead of epoll or select.
+ * Connections are accepted with one multishot accept and every client has one multishot receive
+ * that completes with its input in a provided buffer, so no request is made per wakeup or per read.
+ * Responses are queued as sends at the end of each pass, and every request queued during a pass
+ * is submitted by the same system call that waits for the next completions.
+ */
+void *run_uring_worker(void *arg) {
+    Worker *worker = arg;
+    ClientTable *clients = &worker->clients;
+    User **user_list = worker->user_list;
+    int takes_snapshots = worker == &workers[0];
+
+    Uring ring;
+    if (uring_init(&ring, URING_ENTRIES) == -1 || uring_setup_buffers(&ring, 0, URING_BUFFERS, URING_BUFFER_SIZE) == -1) {
+        perror("server: io_uring");
+        exit(1);
+    }
+    worker_ring = &ring;
+    clients->send_queued = uring_send_queued;
+
+    uring_accept(&ring, worker->listen_fd);
+    if (clients->wake_fd != -1) {
+        uring_poll(&ring, clients->wake_fd, URING_WAKE, 1);
+    }
+
+    while (1) {
+        // Wake up in time for the next snapshot.
+        if (uring_submit_and_wait(&ring, 1, takes_snapshots ? snapshot_timeout() : -1) == -1) {
+            perror("server: io_uring_enter");
+            exit(1);
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+            unsigned long user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&ring);
+
+            Client *client = (Client *)(user_data & ~(unsigned long)URING_TAG_MASK);
+            switch (user_data & URING_TAG_MASK) {
+                case URING_ACCEPT:
+                    if (res >= 0) {
+                        Client *new_client = new_connection(res, clients);
+                        if (!new_client->closed) {
+                            uring_recv(&ring, new_client);
+                            printf("[Server] Accepted connection\n");
+                        }
+                    } else if (res != -EINTR && res != -ECONNABORTED) {
+                        fprintf(stderr, "server: accept: %s\n", strerror(-res));
+                    }
+                    if (!(flags & IORING_CQE_F_MORE)) {
+                        uring_accept(&ring, worker->listen_fd);
+                    }
+                    break;
+                case URING_RECV:
+                    uring_received(&ring, client, res, flags, clients, user_list);
+                    break;
+                case URING_SEND:
+                    uring_sent(&ring, client, res, clients);
+                    break;
+                case URING_WAKE:
+                    // Another worker or the render pool sent messages to our clients, or a snapshot is wanted.
+                    deliver_mail(clients);
+                    if (!(flags & IORING_CQE_F_MORE)) {
+                        uring_poll(&ring, clients->wake_fd, URING_WAKE, 1);
+                    }
+                    break;
+                case URING_SAVE:
+                    // The child saving a snapshot has reported.
+                    finish_snapshot();
+                    break;
+            }
+
+            // A removed client is freed once its last request has completed.
+            if (client != NULL && client->sock_fd == -1 && client->uring_ops == 0) {
+                free_client(client);
+            }
+        }
+
+        // Write the changes made during this pass to the journal together.
+        if (journal != NULL) {
+            journal_commit(journal);
+        }
+
+        // Queue sends of the responses and notifications queued during this pass, one per client,
+        // now that the changes they acknowledge are in the journal.
+        flush_pending_clients(clients);
+
+        // Remove the structs of every client that disconnected during this pass.
+        reap_clients(clients);
+
+        // A snapshot saved in the background reports on a pipe that is polled once.
+        if (takes_snapshots && maybe_snapshot(user_list)) {
+            uring_poll(&ring, background_save.result_fd, URING_SAVE, 0);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Parse <arg>, which must be a whole positive number, into *size.
+ * Return 0 on success or -1 if <arg> is empty, has anything after the number or is not positive.
+ */
+int parse_size(const char *arg, size_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (end == arg || *end != '\0' || arg[0] == '-' || errno == ERANGE || value == 0 || value > SIZE_MAX) {
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    // Parse the command line options.
+    int opt;
+    char *journal_path = NULL;
+    Durability durability = DURABILITY_BATCHED;
+    while ((opt = getopt(argc, argv, "w:l:j:d:s:i:t:r:u")) != -1) {
+        switch (opt) {
+            case 'w':
+                if (parse_size(optarg, &out_high_water) == -1) {
+                    fprintf(stderr, "%s: the output high-water mark must be a positive number of bytes\n", argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'l':
+                if (parse_size(optarg, &max_line_len) == -1) {
+                    fprintf(stderr, "%s: the line limit must be a positive number of bytes\n", argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'j':
+                journal_path = optarg;
+                break;
+            case 's':
+                snapshot_path = optarg;
+                break;
+            case 'i':
+                snapshot_interval = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                num_workers = strtol(optarg, NULL, 10);
+                if (num_workers < 1 || num_workers > MAX_WORKERS) {
+                    fprintf(stderr, "%s: the number of threads must be from 1 to %d\n", argv[0], MAX_WORKERS);
+                    exit(1);
+                }
+#ifdef USE_SELECT
+                if (num_workers != 1) {
+                    fprintf(stderr, "%s: the select build runs a single worker thread\n", argv[0]);
+                    exit(1);
+                }
+#endif
+                break;
+            case 'r':
+                render_threads = strtol(optarg, NULL, 10);
+                if (render_threads < 0) {
+                    fprintf(stderr, "%s: the number of render threads must not be negative\n", argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'u':
+                use_uring = 1;
+                break;
+            case 'd':
+                if (parse_durability(optarg, &durability) == 0) {
+                    break;
+                }
+                // Fall through to the usage message for an unknown durability mode.
+            default:
+                fprintf(stderr, "Usage: %s [-w output_high_water_bytes] [-l max_line_bytes] [-j journal_path] [-d none|batched|per-op]"
+                        " [-s snapshot_path] [-i snapshot_interval_seconds] [-t threads] [-r render_threads] [-u]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    // Setup the list of users, loading the snapshot if there is one and then replaying the
+    // journal records written after it.
+    User *user_list = NULL;
+    off_t journal_offset = 0;
+    if (snapshot_path != NULL) {
+        long num_users = load_snapshot(snapshot_path, &user_list, &journal_offset);
+        if (num_users == -1) {
+            exit(1);
+        }
+        printf("[Server] Loaded %ld users from snapshot %s\n", num_users, snapshot_path);
+        next_snapshot = time(NULL) + snapshot_interval;
+    }
+    Journal server_journal;
+    if (journal_path != NULL) {
+        long num_records = journal_open(&server_journal, journal_path, durability, journal_offset, &user_list);
+        if (num_records == -1) {
+            exit(1);
+        }
+        printf("[Server] Replayed %ld journal records from %s\n", num_records, journal_path);
+        journal = &server_journal;
+    }
+    init_locks();
+
+    // Setup each worker's listening socket and table of clients. Output is batched and sent at
+    // the end of each event loop pass. With several workers or a render pool each worker has an
+    // eventfd that wakes it when other threads send messages to its clients.
+    for (int i = 0; i < num_workers; i++) {
+        Worker *worker = &workers[i];
+        worker->listen_fd = open_listen_socket(num_workers > 1);
+        worker->clients = (ClientTable) {NULL, 0, NULL, NULL, NULL, 1, NULL, NULL, -1, NULL, commit_journal};
+        worker->user_list = &user_list;
+        if ((num_workers > 1 || render_threads > 0) && (worker->clients.wake_fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+            perror("server: eventfd");
+            exit(1);
+        }
+    }
+    start_render_pool(render_threads);
+
+    // Use io_uring if it was asked for and this kernel has everything the io_uring event loop needs.
+    void *(*event_loop)(void *) = run_worker;
+    if (use_uring && uring_supported() == -1) {
+#ifdef USE_SELECT
+        fprintf(stderr, "[Server] io_uring is not supported by this kernel, using select\n");
+#else
+        fprintf(stderr, "[Server] io_uring is not supported by this kernel, using epoll\n");
+#endif
+    } else if (use_uring) {
+        printf("[Server] Using io_uring\n");
+        event_loop = run_uring_worker;
+    }
+
+    // Worker 0 runs on this thread.
+    for (int i = 1; i < num_workers; i++) {
+        int error = pthread_create(&workers[i].thread, NULL, event_loop, &workers[i]);
+        if (error != 0) {
+            fprintf(stderr, "server: pthread_create: %s\n", strerror(error));
+            exit(1);
+        }
+    }
+    if (num_workers > 1) {
+        printf("[Server] Running %d worker threads\n", num_workers);
     }
+    event_loop(&workers[0]);
 
     // Should never get here.
 	return 1;
@@ -1,11 +1,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "friends.h"
+#include "command.h"
 
 #define INPUT_BUFFER_SIZE 256
-#define INPUT_ARG_MAX_NUM 12
-#define DELIM " \n"
+#define ADD_USER_CMD "add_user "
+#define DEFAULT_FEED_POSTS 10  // Posts printed by feed when no number is given
+#define DEFAULT_PAGE_POSTS 10  // Posts on a page of a profile when an offset but no limit is given
+#define DEFAULT_SUGGESTIONS 10  // Users suggested by suggest when no number is given
+
+// Mutual friend counts for suggest, reused by every suggest command.
+static MutualCounts mutual_counts = {NULL, 0, NULL, 0, 0};
 
 
 /* 
@@ -16,19 +27,35 @@ void error(char *msg) {
 }
 
 /* 
- * Read and process commands
+ * Read and process the <len> byte command <line>. A trailing newline is ignored.
  * Return:  -1 for quit command
  *          0 otherwise
  */
-int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
+int process_args(const char *line, size_t len, User **user_list_ptr) {
     User *user_list = *user_list_ptr;
+    Tokenizer tokenizer;
+    Slice cmd;
+    Slice args[3];
+    char name1[MAX_NAME + 1];
+    char name2[MAX_NAME + 1];
 
-    if (cmd_argc <= 0) {
+    tokenizer_init(&tokenizer, line, len);
+    if (!next_token(&tokenizer, &cmd)) {
         return 0;
-    } else if (strcmp(cmd_argv[0], "quit") == 0 && cmd_argc == 1) {
+    }
+
+    switch (lookup_command(cmd)) {
+    case CMD_QUIT:
+        if (exact_args(&tokenizer, args, 0) == -1) {
+            break;
+        }
         return -1;
-    } else if (strcmp(cmd_argv[0], "add_user") == 0 && cmd_argc == 2) {
-        switch (create_user(cmd_argv[1], user_list_ptr)) {
+    case CMD_ADD_USER:
+        if (exact_args(&tokenizer, args, 1) == -1) {
+            break;
+        }
+        copy_name(args[0], name1);
+        switch (create_user(name1, user_list_ptr)) {
             case 1:
                 error("user by this name already exists");
                 break;
@@ -36,13 +63,20 @@ int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
                 error("username is too long");
                 break;
         }
-
-    } else if (strcmp(cmd_argv[0], "list_users") == 0 && cmd_argc == 1) {
-		char *buf = list_users(user_list);
-		printf("%s", buf);
-		free(buf);
-    } else if (strcmp(cmd_argv[0], "make_friends") == 0 && cmd_argc == 3) {
-        switch (make_friends(cmd_argv[1], cmd_argv[2], user_list)) {
+        return 0;
+    case CMD_LIST_USERS:
+        if (exact_args(&tokenizer, args, 0) == -1) {
+            break;
+        }
+        fputs(cached_user_list(user_list), stdout);
+        return 0;
+    case CMD_MAKE_FRIENDS:
+        if (exact_args(&tokenizer, args, 2) == -1) {
+            break;
+        }
+        copy_name(args[0], name1);
+        copy_name(args[1], name2);
+        switch (make_friends(name1, name2, user_list)) {
             case 1:
                 error("users are already friends");
                 break;
@@ -56,30 +90,20 @@ int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
                 error("at least one user you entered does not exist");
                 break;
         }
-    } else if (strcmp(cmd_argv[0], "post") == 0 && cmd_argc >= 4) {
-        // first determine how long a string we need
-        int space_needed = 0;
-        for (int i = 3; i < cmd_argc; i++) {
-            space_needed += strlen(cmd_argv[i]) + 1;
-        }
-
-        // allocate the space
-        char *contents = malloc(space_needed);
-        if (contents == NULL) {
-            perror("malloc");
-            exit(1);
-        }
-
-        // copy in the bits to make a single string
-        strcpy(contents, cmd_argv[3]);
-        for (int i = 4; i < cmd_argc; i++) {
-            strcat(contents, " ");
-            strcat(contents, cmd_argv[i]);
+        return 0;
+    case CMD_POST: {
+        // The contents are the rest of the line, with its whitespace as it was typed.
+        Slice contents;
+        if (!next_token(&tokenizer, &args[0]) || !next_token(&tokenizer, &args[1])
+            || (contents = rest_of_line(&tokenizer)).len == 0) {
+            break;
         }
+        copy_name(args[0], name1);
+        copy_name(args[1], name2);
 
-        User *author = find_user(cmd_argv[1], user_list);
-        User *target = find_user(cmd_argv[2], user_list);
-        switch (make_post(author, target, contents)) {
+        User *author = find_user(name1, user_list);
+        User *target = find_user(name2, user_list);
+        switch (make_post_copy(author, target, contents.data, contents.len)) {
             case 1:
                 error("the users are not friends");
                 break;
@@ -87,45 +111,184 @@ int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
                 error("at least one user you entered does not exist");
                 break;
         }
-    } else if (strcmp(cmd_argv[0], "profile") == 0 && cmd_argc == 2) {
-        User *user = find_user(cmd_argv[1], user_list);
-		if (user == NULL) {
-			error("user not found");
-		} else {
-			char *buf = print_user(user);
-			printf("%s", buf);
-			free(buf);
-		}
-    } else {
-        error("Incorrect syntax");
+        return 0;
     }
+    case CMD_PROFILE: {
+        // An offset and a limit, both optional, ask for one page of the user's posts.
+        unsigned int offset = 0;
+        unsigned int limit = DEFAULT_PAGE_POSTS;
+        if (!next_token(&tokenizer, &args[0])) {
+            break;
+        }
+        int paged = next_token(&tokenizer, &args[1]);
+        if (paged && (parse_number(args[1], &offset) == -1
+                || (next_token(&tokenizer, &args[2]) && parse_number(args[2], &limit) == -1)
+                || exact_args(&tokenizer, args, 0) == -1)) {
+            break;
+        }
+        copy_name(args[0], name1);
+        User *user = find_user(name1, user_list);
+        if (user == NULL) {
+            error("user not found");
+        } else if (paged) {
+            StrBuf page = {NULL, 0, 0};
+            render_profile_page(user, offset, limit, &page);
+            fputs(page.data, stdout);
+            free(page.data);
+        } else {
+            fputs(cached_profile(user), stdout);
+        }
+        return 0;
+    }
+    case CMD_POSTS: {
+        unsigned int since;
+        if (exact_args(&tokenizer, args, 3) == -1 || args[1].len != 5 || memcmp(args[1].data, "since", 5) != 0
+            || parse_number(args[2], &since) == -1) {
+            break;
+        }
+        copy_name(args[0], name1);
+        User *user = find_user(name1, user_list);
+        if (user == NULL) {
+            error("user not found");
+        } else {
+            StrBuf posts = {NULL, 0, 0};
+            render_posts_since(user, since, &posts);
+            fputs(posts.data, stdout);
+            free(posts.data);
+        }
+        return 0;
+    }
+    case CMD_SUGGEST: {
+        // The number of suggestions is optional.
+        unsigned int max_suggestions = DEFAULT_SUGGESTIONS;
+        if (!next_token(&tokenizer, &args[0]) || (next_token(&tokenizer, &args[1])
+                && (parse_number(args[1], &max_suggestions) == -1 || exact_args(&tokenizer, args, 0) == -1))) {
+            break;
+        }
+        copy_name(args[0], name1);
+        User *user = find_user(name1, user_list);
+        if (user == NULL) {
+            error("user not found");
+        } else {
+            for (unsigned int i = 0; i < user->friends.count; i++) {
+                count_mutual_friends(&mutual_counts, user->friends.members[i]);
+            }
+            StrBuf suggestions = {NULL, 0, 0};
+            render_suggestions(&mutual_counts, user, user->friends.members, user->friends.count,
+                               max_suggestions, &suggestions);
+            fputs(suggestions.data, stdout);
+            free(suggestions.data);
+        }
+        return 0;
+    }
+    case CMD_FEED: {
+        // The number of posts is optional.
+        unsigned int max_posts = DEFAULT_FEED_POSTS;
+        if (!next_token(&tokenizer, &args[0]) || (next_token(&tokenizer, &args[1])
+                && (parse_number(args[1], &max_posts) == -1 || exact_args(&tokenizer, args, 0) == -1))) {
+            break;
+        }
+        copy_name(args[0], name1);
+        User *user = find_user(name1, user_list);
+        if (user == NULL) {
+            error("user not found");
+        } else {
+            StrBuf feed = {NULL, 0, 0};
+            render_feed(user, max_posts, &feed);
+            fputs(feed.data, stdout);
+            free(feed.data);
+        }
+        return 0;
+    }
+    default:
+        break;
+    }
+
+    // The command is unknown or has the wrong number of arguments.
+    error("Incorrect syntax");
     return 0;
 }
 
 
 /*
- * Tokenize the string stored in cmd.
- * Return the number of tokens, and store the tokens in cmd_argv.
+ * Run every command in the file at <path> without echoing it, as fast as possible, and report
+ * the throughput on stderr. The file is mapped rather than read, and the user index is sized for
+ * every add_user command up front.
  */
-int tokenize(char *cmd, char **cmd_argv) {
-    int cmd_argc = 0;
-    char *next_token = strtok(cmd, DELIM);    
-    while (next_token != NULL) {
-        if (cmd_argc >= INPUT_ARG_MAX_NUM - 1) {
-            error("Too many arguments!");
-            cmd_argc = 0;
+void bulk_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening file");
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    const char *input = "";
+    if (st.st_size > 0) {
+        input = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (input == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        madvise((void *)input, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    const char *input_end = input + st.st_size;
+
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Count the users the file creates so the index is only sized once.
+    unsigned int num_users = 0;
+    for (const char *line = input; line < input_end; line++) {
+        if (input_end - line >= sizeof(ADD_USER_CMD) - 1 && memcmp(line, ADD_USER_CMD, sizeof(ADD_USER_CMD) - 1) == 0) {
+            num_users++;
+        }
+        line = memchr(line, '\n', input_end - line);
+        if (line == NULL) {
+            break;
+        }
+    }
+
+    User *user_list = NULL;
+    long num_commands = 0;
+    const char *line = input;
+    while (line < input_end) {
+        const char *end = memchr(line, '\n', input_end - line);
+        const char *next = end == NULL ? input_end : end + 1;
+        if (end == NULL) {
+            end = input_end;
+        }
+
+        int had_users = user_list != NULL;
+        int result = process_args(line, end - line, &user_list);
+        if (!had_users && user_list != NULL) {
+            reserve_users(user_list, num_users);
+        }
+        num_commands++;
+        if (result == -1) {
             break;
         }
-        cmd_argv[cmd_argc] = next_token;
-        cmd_argc++;
-        next_token = strtok(NULL, DELIM);
+        line = next;
     }
 
-    return cmd_argc;
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    fflush(stdout);
+    double elapsed = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Processed %ld commands in %.3f s (%.0f commands/sec)\n",
+            num_commands, elapsed, elapsed > 0 ? num_commands / elapsed : 0);
 }
 
 
 int main(int argc, char* argv[]) {
+    if (argc == 3 && strcmp(argv[1], "-b") == 0) {
+        bulk_load(argv[2]);
+        return 0;
+    }
+
     int batch_mode = (argc == 2);
     char input[INPUT_BUFFER_SIZE];
     FILE *input_stream;
@@ -153,10 +316,7 @@ int main(int argc, char* argv[]) {
             printf("%s", input);
         }
 
-        char *cmd_argv[INPUT_ARG_MAX_NUM];
-        int cmd_argc = tokenize(input, cmd_argv);
-
-        if (cmd_argc > 0 && process_args(cmd_argc, cmd_argv, &user_list) == -1) {
+        if (process_args(input, strlen(input), &user_list) == -1) {
             break; // can only reach if quit command was entered
         }
 
@@ -1,9 +1,137 @@
 #include "friends.h"
+#include "slab.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 
+#define USER_TABLE_INITIAL_CAPACITY 64  // Must be a power of two
+#define USER_LIST_HEADER "User List\n"
+#define PROFILE_SEPARATOR "------------------------------------------\n"  // Separates the parts of a profile
+
+// Every user and post comes from one of these pools. Each thread has its own pools so allocating
+// never needs a lock; users and posts are never freed, so no object goes back to another thread's pool.
+static __thread SlabPool user_pool = SLAB_POOL(User);
+static __thread SlabPool post_pool = SLAB_POOL(Post);
+
+// Counters reported by profile_cache_stats, updated atomically since any thread may render a profile.
+static unsigned long profile_cache_hits = 0;
+static unsigned long profile_cache_misses = 0;
+
+// A user suggested as a friend, with the number of mutual friends it shares with the user.
+typedef struct suggestion {
+    const User *user;
+    unsigned int id;
+    unsigned int count;
+} Suggestion;
+
+// The next post to merge from one wall into a feed, for render_feed.
+typedef struct feed_entry {
+    const Post *post;
+    const User *wall;  // The user whose wall the post is on
+} FeedEntry;
+
+
+/*
+ * Ensure <buf> has room for <len> more bytes plus a null terminator.
+ */
+void reserve_str(StrBuf *buf, size_t len) {
+    if (buf->len + len + 1 <= buf->cap) {
+        return;
+    }
+
+    size_t new_cap = buf->cap == 0 ? 256 : buf->cap;
+    while (new_cap < buf->len + len + 1) {
+        new_cap *= 2;
+    }
+    char *data = realloc(buf->data, new_cap);
+    if (data == NULL) {
+        perror("string buffer realloc");
+        exit(1);
+    }
+    buf->data = data;
+    buf->cap = new_cap;
+}
+
+
+/*
+ * Append the <len> bytes at <str> to <buf>, keeping it null terminated.
+ */
+void append_str(StrBuf *buf, const char *str, size_t len) {
+    reserve_str(buf, len);
+    memcpy(&buf->data[buf->len], str, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+
+/*
+ * Append the null terminated string <str> to <buf>.
+ */
+void append_cstr(StrBuf *buf, const char *str) {
+    append_str(buf, str, strlen(str));
+}
+
+
+/*
+ * Return the FNV-1a hash of the null terminated string <name>.
+ */
+static unsigned int hash_name(const char *name) {
+    unsigned int hash = 2166136261u;
+    while (*name != '\0') {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+        name++;
+    }
+    return hash;
+}
+
+
+/*
+ * Return the slot in <table> holding the user named <name>, or the empty slot
+ * where that user would be inserted if it is not in the table.
+ */
+static User **table_slot(const UserTable *table, const char *name) {
+    unsigned int mask = table->capacity - 1;
+    unsigned int i = hash_name(name) & mask;
+    while (table->slots[i] != NULL && strcmp(table->slots[i]->name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &table->slots[i];
+}
+
+
+/*
+ * Allocate a table of <capacity> empty slots. <capacity> must be a power of two.
+ */
+static User **alloc_slots(unsigned int capacity) {
+    User **slots = calloc(capacity, sizeof(User *));
+    if (slots == NULL) {
+        perror("user table malloc");
+        exit(1);
+    }
+    return slots;
+}
+
+
+/*
+ * Change the capacity of <table> to <capacity>, a power of two, and rehash every user into the new slots.
+ */
+static void resize_table(UserTable *table, unsigned int capacity) {
+    User **old_slots = table->slots;
+    unsigned int old_capacity = table->capacity;
+
+    table->capacity = capacity;
+    table->slots = alloc_slots(table->capacity);
+    for (unsigned int i = 0; i < old_capacity; i++) {
+        if (old_slots[i] != NULL) {
+            *table_slot(table, old_slots[i]->name) = old_slots[i];
+        }
+    }
+    free(old_slots);
+}
+
+
 /*
  * Create a new user with the given name.  Insert it at the tail of the list
  * of users whose head is pointed to by *user_ptr_add.
@@ -19,11 +147,33 @@ int create_user(const char *name, User **user_ptr_add) {
         return 2;
     }
 
-    User *new_user = malloc(sizeof(User));
-    if (new_user == NULL) {
-        perror("malloc");
-        exit(1);
+    // The first user of a list creates the table every later user shares.
+    UserTable *table;
+    if (*user_ptr_add == NULL) {
+        table = malloc(sizeof(UserTable));
+        if (table == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        table->capacity = USER_TABLE_INITIAL_CAPACITY;
+        table->slots = alloc_slots(table->capacity);
+        table->count = 0;
+        table->head = NULL;
+        table->tail = NULL;
+        table->user_list.data = NULL;
+        table->user_list.len = 0;
+        table->user_list.cap = 0;
+        append_cstr(&table->user_list, USER_LIST_HEADER);
+    } else {
+        table = (*user_ptr_add)->table;
+    }
+
+    User **slot = table_slot(table, name);
+    if (*slot != NULL) {
+        return 1;
     }
+
+    User *new_user = slab_alloc(&user_pool);
     strncpy(new_user->name, name, MAX_NAME); // name has max length MAX_NAME - 1
 
     for (int i = 0; i < MAX_NAME; i++) {
@@ -31,28 +181,60 @@ int create_user(const char *name, User **user_ptr_add) {
     }
 
     new_user->first_post = NULL;
+    new_user->posts.posts = NULL;
+    new_user->posts.count = 0;
+    new_user->posts.capacity = 0;
     new_user->next = NULL;
-    for (int i = 0; i < MAX_FRIENDS; i++) {
-        new_user->friends[i] = NULL;
-    }
+    new_user->friends.count = 0;
+    new_user->friends.capacity = FRIENDS_INLINE;
+    new_user->friends.members = new_user->friends.inline_members;
+    new_user->friends.ids = new_user->friends.inline_ids;
+    new_user->friends.index = NULL;
+    new_user->friends.index_capacity = 0;
+    new_user->table = table;
+    new_user->id = table->count;
+    new_user->first_session = NULL;
+    new_user->profile.data = NULL;
+    new_user->profile.len = 0;
+    new_user->profile.cap = 0;
+    new_user->profile_valid = 0;
 
-    // Add user to list
-    User *prev = NULL;
-    User *curr = *user_ptr_add;
-    while (curr != NULL && strcmp(curr->name, name) != 0) {
-        prev = curr;
-        curr = curr->next;
+    // Add user to the index, keeping it at most half full so probe sequences stay short.
+    *slot = new_user;
+    table->count++;
+    if (table->count * 2 > table->capacity) {
+        resize_table(table, table->capacity * 2);
     }
 
+    // Add user to the tail of the list
     if (*user_ptr_add == NULL) {
         *user_ptr_add = new_user;
-        return 0;
-    } else if (curr != NULL) {
-        free(new_user);
-        return 1;
+        table->head = new_user;
     } else {
-        prev->next = new_user;
-        return 0;
+        table->tail->next = new_user;
+    }
+    table->tail = new_user;
+
+    // Keep the listing returned by list_users up to date.
+    append_str(&table->user_list, "\t", 1);
+    append_cstr(&table->user_list, new_user->name);
+    append_str(&table->user_list, "\n", 1);
+    return 0;
+}
+
+
+/*
+ * Make room in the index of the list starting at <head>, which must not be empty, for <num_users>
+ * users in total, so creating that many users never has to rehash it.
+ */
+void reserve_users(User *head, unsigned int num_users) {
+    UserTable *table = head->table;
+    unsigned int capacity = table->capacity;
+    while (capacity / 2 < num_users) {
+        capacity *= 2;
+    }
+    if (capacity > table->capacity) {
+        resize_table(table, capacity);
     }
 }
 
@@ -60,16 +242,31 @@ int create_user(const char *name, User **user_ptr_add) {
 /*
  * Return a pointer to the user with this name in
  * the list starting with head. Return NULL if no such user exists.
+ * <head> must be the head of a list built with create_user (or NULL).
  *
  * NOTE: You'll likely need to cast a (const User *) to a (User *)
  * to satisfy the prototype without warnings.
  */
 User *find_user(const char *name, const User *head) {
-    while (head != NULL && strcmp(name, head->name) != 0) {
-        head = head->next;
+    if (head == NULL) {
+        return NULL;
     }
 
-    return (User *)head;
+    return *table_slot(head->table, name);
+}
+
+
+/*
+ * Return the usernames of all users in the list starting at <head>, in the format
+ * returned by list_users, without copying it.
+ * The listing is maintained by create_user, so the string is only valid until the next
+ * user is created. <head> must be the head of a list built with create_user (or NULL).
+ */
+const char *cached_user_list(const User *head) {
+    if (head == NULL) {
+        return USER_LIST_HEADER;
+    }
+    return head->table->user_list.data;
 }
 
 
@@ -78,54 +275,118 @@ User *find_user(const char *name, const User *head) {
  * The string returned will list the users one per line.
  */
 char *list_users(const User *curr) {
-    char *list_header = "User List\n";
-	// First, determine the size of the string we need.
-	int str_size = strlen(list_header);
-	const User *curr_user = curr;
-    while (curr_user != NULL) {
-		str_size += 2 + strlen(curr_user->name);  // Account for tab and newline characters with the +2
-        curr_user = curr_user->next;
+    StrBuf buf = {NULL, 0, 0};
+
+    if (curr != NULL && curr == curr->table->head) {
+        // The whole list was asked for so copy the listing create_user maintains.
+        append_str(&buf, curr->table->user_list.data, curr->table->user_list.len);
+        return buf.data;
+    }
+
+    append_cstr(&buf, USER_LIST_HEADER);
+    while (curr != NULL) {
+        append_str(&buf, "\t", 1);
+        append_cstr(&buf, curr->name);
+        append_str(&buf, "\n", 1);
+        curr = curr->next;
+    }
+    return buf.data;
+}
+
+
+/*
+ * Return the slot of the hash set <index> with <index_capacity> slots holding <user>,
+ * or the empty slot where it would be inserted if it is not in the set.
+ */
+static User **friend_slot(User **index, unsigned int index_capacity, const User *user) {
+    unsigned int mask = index_capacity - 1;
+    // Users are at least 16 byte aligned so the low bits of their address carry no information.
+    unsigned int i = (unsigned int)(((unsigned long)user >> 4) * 2654435761u) & mask;
+    while (index[i] != NULL && index[i] != user) {
+        i = (i + 1) & mask;
     }
-	str_size += 1;  // Account for the null terminator
+    return &index[i];
+}
 
-	// Now construct the string
-	char *user_list_str = malloc(str_size);
-	if (user_list_str == NULL) {
-		perror("user list malloc");
-		exit(1);
-	}
 
-	// Copy over the heading first. This also fills the rest of user_list with the null terminator
-	strncpy(user_list_str, list_header, str_size);
-	while (curr != NULL) {
-		// Use of strcat is safe here because we've already looped through these strings and counted
-		// the number of bytes total so no buffer overruns are possible here.
-		// Properly using strncat here would mean keeping track of the remaining size of the buffer which is
-		// inefficient as we have already counted so strcat is used here instead.
+/*
+ * Return 1 if <friend> is in the friends of <user> and 0 otherwise.
+ */
+int is_friend(const User *user, const User *friend) {
+    const FriendSet *set = &user->friends;
+    if (set->index == NULL) {
+        // Small sets are still inline so a scan touches no more memory than a hash lookup would.
+        for (unsigned int i = 0; i < set->count; i++) {
+            if (set->members[i] == friend) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    return *friend_slot(set->index, set->index_capacity, friend) != NULL;
+}
+
 
-		strcat(user_list_str, "\t");
-		strcat(user_list_str, curr->name);
-		strcat(user_list_str, "\n");
-		curr = curr->next;
-	}
-	// strncpy null terminates the string but we verify this anyways
-	user_list_str[str_size - 1] = '\0';
+/*
+ * Add <friend>, which must not already be in the set, to the end of <set>.
+ * This only changes one side of the friendship; make_friends adds both.
+ */
+void add_friend(FriendSet *set, User *friend) {
+    if (set->count == set->capacity) {
+        // Move the members to the heap, doubling their room.
+        unsigned int new_capacity = set->capacity * 2;
+        User **members = malloc(new_capacity * sizeof(User *));
+        if (members == NULL) {
+            perror("friend set malloc");
+            exit(1);
+        }
+        unsigned int *ids = malloc(new_capacity * sizeof(unsigned int));
+        if (ids == NULL) {
+            perror("friend set malloc");
+            exit(1);
+        }
+        memcpy(members, set->members, set->count * sizeof(User *));
+        memcpy(ids, set->ids, set->count * sizeof(unsigned int));
+        if (set->members != set->inline_members) {
+            free(set->members);
+            free(set->ids);
+        }
+        set->members = members;
+        set->ids = ids;
+        set->capacity = new_capacity;
+    }
+    set->ids[set->count] = friend->id;
+    set->members[set->count++] = friend;
 
-	return user_list_str;
+    if (set->count > FRIENDS_INLINE && set->count * 2 > set->index_capacity) {
+        // Rebuild the hash set with room for twice as many members so it stays at most half full.
+        free(set->index);
+        set->index_capacity = set->index_capacity == 0 ? 4 * FRIENDS_INLINE : set->index_capacity * 2;
+        set->index = calloc(set->index_capacity, sizeof(User *));
+        if (set->index == NULL) {
+            perror("friend set malloc");
+            exit(1);
+        }
+        for (unsigned int i = 0; i < set->count; i++) {
+            *friend_slot(set->index, set->index_capacity, set->members[i]) = set->members[i];
+        }
+    } else if (set->index != NULL) {
+        *friend_slot(set->index, set->index_capacity, friend) = friend;
+    }
 }
 
 
 /*
  * Make two users friends with each other.  This is symmetric - a pointer to
- * each user must be stored in the 'friends' array of the other.
+ * each user must be stored in the 'friends' set of the other.
  *
- * New friends must be added in the first empty spot in the 'friends' array.
+ * New friends are added at the end of the 'friends' set.
  *
  * Return:
  *   - 0 on success.
  *   - 1 if the two users are already friends.
  *   - 2 if the users are not already friends, but at least one already has
- *     MAX_FRIENDS friends.
+ *     MAX_FRIENDS friends (never when MAX_FRIENDS is 0).
  *   - 3 if the same user is passed in twice.
  *   - 4 if at least one user does not exist.
  *
@@ -140,65 +401,251 @@ int make_friends(const char *name1, const char *name2, User *head) {
         return 4;
     } else if (user1 == user2) { // Same user
         return 3;
+    } else if (is_friend(user1, user2)) { // Already friends.
+        return 1;
     }
 
-    int i, j;
-    for (i = 0; i < MAX_FRIENDS; i++) {
-        if (user1->friends[i] == NULL) { // Empty spot
-            break;
-        } else if (user1->friends[i] == user2) { // Already friends.
-            return 1;
+    if (MAX_FRIENDS > 0 && (user1->friends.count >= MAX_FRIENDS || user2->friends.count >= MAX_FRIENDS)) {
+        // Too many friends.
+        return 2;
+    }
+
+    add_friend(&user1->friends, user2);
+    add_friend(&user2->friends, user1);
+    // Both friend lists changed.
+    user1->profile_valid = 0;
+    user2->profile_valid = 0;
+    return 0;
+}
+
+
+/*
+ * Append the string representing the post <post> to <buf>.
+ * Use localtime to identify the time and date.
+ * <post> must not be NULL.
+ */
+static void render_post(const Post *post, StrBuf *buf) {
+    // asctime_r writes at most 26 bytes, including its newline and null terminator.
+    struct tm post_tm;
+    char date[26];
+    asctime_r(localtime_r(&post->date, &post_tm), date);
+
+    append_str(buf, "From: ", 6);
+    append_cstr(buf, post->author);
+    append_str(buf, "\nDate: ", 7);
+    append_cstr(buf, date);
+    append_str(buf, "\n", 1);
+    append_cstr(buf, post->contents);
+    append_str(buf, "\n", 1);
+}
+
+
+/*
+ * Append the start of the profile of the user named <name>, with the <num_friends> friends at
+ * <friends>, to <buf>: everything in the format returned by print_user before the first post.
+ */
+static void render_profile_head(const char *name, User *const *friends, unsigned int num_friends, StrBuf *buf) {
+    // Add the name
+    append_str(buf, "Name: ", 6);
+    append_cstr(buf, name);
+    append_str(buf, "\n\n", 2);
+    append_cstr(buf, PROFILE_SEPARATOR);
+
+    // Add the friend list.
+    append_cstr(buf, "Friends:\n");
+    for (unsigned int i = 0; i < num_friends; i++) {
+        append_cstr(buf, friends[i]->name);
+        append_str(buf, "\n", 1);
+    }
+    append_cstr(buf, PROFILE_SEPARATOR);
+    append_cstr(buf, "Posts:\n");
+}
+
+
+/*
+ * Append the profile of the user named <name>, with the <num_friends> friends at <friends> and
+ * the posts starting at <first_post>, to <buf>. This is the format returned by print_user.
+ */
+static void render_profile(const char *name, User *const *friends, unsigned int num_friends,
+                           const Post *first_post, StrBuf *buf) {
+    render_profile_head(name, friends, num_friends, buf);
+
+    // Add the post list.
+    for (const Post *curr = first_post; curr != NULL; curr = curr->next) {
+        if (curr != first_post) { // Only add the separator between posts
+            append_cstr(buf, "\n===\n\n");
         }
+        render_post(curr, buf);
     }
+    append_cstr(buf, PROFILE_SEPARATOR);
+}
 
-    for (j = 0; j < MAX_FRIENDS; j++) {
-        if (user2->friends[j] == NULL) { // Empty spot
-            break;
+
+/*
+ * Append the posts at positions <first> down to <last> of <index>, newest first, to <buf>,
+ * with the separator between posts used in profiles. <first> must be at least <last>.
+ */
+static void render_indexed_posts(const PostIndex *index, unsigned int first, unsigned int last, StrBuf *buf) {
+    for (unsigned int i = first + 1; i-- > last;) {
+        if (i != first) { // Only add the separator between posts
+            append_cstr(buf, "\n===\n\n");
         }
+        render_post(index->posts[i], buf);
     }
+}
 
-    if (i == MAX_FRIENDS || j == MAX_FRIENDS) { // Too many friends.
-        return 2;
+
+/*
+ * Append the profile of <user> to <buf> in the format returned by print_user, but with only
+ * <limit> of its posts, starting <offset> posts from the newest. Only the posts on the page are
+ * visited. <user> must not be NULL.
+ */
+void render_profile_page(const User *user, unsigned int offset, unsigned int limit, StrBuf *buf) {
+    const PostIndex *index = &user->posts;
+    render_profile_head(user->name, user->friends.members, user->friends.count, buf);
+
+    // The newest post is last in the index.
+    if (offset < index->count && limit > 0) {
+        unsigned int first = index->count - 1 - offset;
+        unsigned int last = first + 1 > limit ? first + 1 - limit : 0;
+        render_indexed_posts(index, first, last, buf);
     }
+    append_cstr(buf, PROFILE_SEPARATOR);
+}
 
-    user1->friends[i] = user2;
-    user2->friends[j] = user1;
-    return 0;
+
+/*
+ * Append the posts on the wall of <user> made at or after <since>, newest first, to <buf>.
+ * The oldest of them is found by binary search, so only the posts sent are visited.
+ * <user> must not be NULL.
+ */
+void render_posts_since(const User *user, time_t since, StrBuf *buf) {
+    const PostIndex *index = &user->posts;
+
+    // Find the first post in the index, the oldest, that is not before <since>.
+    unsigned int low = 0;
+    unsigned int high = index->count;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (index->posts[mid]->date < since) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    append_cstr(buf, "Posts:\n");
+    if (low < index->count) {
+        render_indexed_posts(index, index->count - 1, low, buf);
+    }
+    append_cstr(buf, PROFILE_SEPARATOR);
 }
 
 
 /*
- * Return a string representing the post <post>.
- * Use localtime to identify the time and date.
- * <post> must not be NULL.
+ * Append the string representing a user profile to <buf>.
+ * This is the format returned by print_user.
+ * <user> must not be NULL.
  */
-char *print_post(const Post *post) {
-	// Determine the size of the string we need
-	int str_size = 0;
-	// +7 accounts for the "From: " and the newline
-	str_size += strlen(post->author) + 7;
-	// +7 accounts for the "Date: " and the newline
-	str_size += strlen(asctime(localtime(post->date))) + 7;
-	// +1 accounts for the newline
-	str_size += strlen(post->contents) + 1;
-	str_size += 1;  // Account for null terminator
+void render_user(const User *user, StrBuf *buf) {
+    render_profile(user->name, user->friends.members, user->friends.count, user->first_post, buf);
+}
+
 
-	// Allocate space for string
-	char *post_str = malloc(str_size);
-	if (post_str == NULL) {
-		perror("post malloc");
-		exit(1);
-	}
+/*
+ * Return the string representing a user profile, in the format returned by print_user.
+ * The profile is rendered once and cached in the user until a post or friend is added to it,
+ * so the string is only valid until the next call to make_post or make_friends for this user.
+ * <user> must not be NULL.
+ */
+const char *cached_profile(const User *user) {
+    // The cache is not part of the user's value so it is updated through a non-const pointer.
+    User *cached_user = (User *)user;
+    if (cached_user->profile_valid) {
+        __atomic_fetch_add(&profile_cache_hits, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&profile_cache_misses, 1, __ATOMIC_RELAXED);
+        // Reuse the cache's buffer for the new render.
+        cached_user->profile.len = 0;
+        render_user(user, &cached_user->profile);
+        cached_user->profile_valid = 1;
+    }
+    return cached_user->profile.data;
+}
 
-    // Add items to the string
-	snprintf(post_str,
-			 str_size,
-			 "From: %s\nDate: %s\n%s\n",
-             post->author,
-             asctime(localtime(post->date)),
-             post->contents);
 
-	return post_str;
+/*
+ * Return the profile of <user> if its cache is up to date, counting a hit, like cached_profile.
+ * Otherwise count a miss, set <view> to a view of the user for render_profile_view and return NULL.
+ * <user> must not be NULL.
+ */
+const char *cached_profile_or_view(const User *user, ProfileView *view) {
+    if (user->profile_valid) {
+        return cached_profile(user);
+    }
+    __atomic_fetch_add(&profile_cache_misses, 1, __ATOMIC_RELAXED);
+
+    // Posts are only ever added at the front of the list and are never changed or freed, so the
+    // current first post is the head of a list that stays the same. The friends are copied
+    // since their array moves as it grows.
+    view->user = user;
+    view->first_post = user->first_post;
+    view->num_friends = user->friends.count;
+    view->friends = malloc((view->num_friends > 0 ? view->num_friends : 1) * sizeof(User *));
+    if (view->friends == NULL) {
+        perror("profile view malloc");
+        exit(1);
+    }
+    memcpy(view->friends, user->friends.members, view->num_friends * sizeof(User *));
+    return NULL;
+}
+
+
+/*
+ * Append the profile of the user as it was when <view> was taken to <buf>, in the format
+ * returned by print_user. The user does not need to be locked, so this can run on another thread
+ * while the user changes.
+ */
+void render_profile_view(const ProfileView *view, StrBuf *buf) {
+    render_profile(view->user->name, view->friends, view->num_friends, view->first_post, buf);
+}
+
+
+/*
+ * Store the <len> byte profile at <profile>, rendered from <view>, as the cached profile of the
+ * view's user if the user has not changed since the view was taken.
+ * Return 1 if the profile was cached and 0 if it is already out of date.
+ */
+int cache_profile_view(const ProfileView *view, const char *profile, size_t len) {
+    User *user = (User *)view->user;
+    // Friends and posts are only ever added, so the same counts and head mean the same profile.
+    if (user->profile_valid || user->first_post != view->first_post
+            || user->friends.count != view->num_friends) {
+        return 0;
+    }
+    user->profile.len = 0;
+    append_str(&user->profile, profile, len);
+    user->profile_valid = 1;
+    return 1;
+}
+
+
+/*
+ * Free the memory held by <view>.
+ */
+void free_profile_view(ProfileView *view) {
+    free(view->friends);
+    view->friends = NULL;
+}
+
+
+/*
+ * Set <hits> and <misses> to the number of times cached_profile (or print_user) found the user's
+ * profile in the cache and the number of times it had to render it.
+ */
+void profile_cache_stats(unsigned long *hits, unsigned long *misses) {
+    *hits = __atomic_load_n(&profile_cache_hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&profile_cache_misses, __ATOMIC_RELAXED);
 }
 
 
@@ -209,134 +656,386 @@ char *print_post(const Post *post) {
  * <user> must not be NULL.
  */
 char *print_user(const User *user) {
-	// Declare a few known strings to minimize error in counting
-	// The string used to separate different parts of the profile
-	char *separator = "------------------------------------------\n";
-	int sep_size = strlen(separator);
-	char *friends_list_header = "Friends:\n";
-	char *post_list_header = "Posts:\n";
-	char *post_separator = "\n===\n\n";
-
-	// Determine the size of the string we need
-	int str_size = 0;
-	// +8 accounts for "Name: " and two newlines
-	str_size += strlen(user->name) + 8;
-	str_size += sep_size;
-	str_size += strlen(friends_list_header);
-	// Loop through and count the size of all of the user's friend's names
-	// plus an additional character for the newline
-	for (int i = 0; i < MAX_FRIENDS && user->friends[i] != NULL; i++) {
-		str_size += strlen(user->friends[i]->name) + 1;
-	}
-	str_size += sep_size;
-	str_size += strlen(post_list_header);
-	// Loop through and count the size of the posts
-	const Post *curr = user->first_post;
-	while (curr != NULL) {
-		char *post_str = print_post(curr);
-		str_size += strlen(post_str);
-		curr = curr->next;
-		if (curr != NULL) { // Only add the separator if there is another post
-			str_size += strlen(post_separator);
-		}
-		// Free the post string after counting the length instead of trying to keep track of all
-        // of the posts here. print_post should not differ from call to call with the same args.
-		free(post_str);
-	}
-	str_size += sep_size;
-	str_size += 1;  // Account for the null terminator.
-
-	// Allocate space for the string
-	char *profile_str = malloc(str_size);
-	if (profile_str == NULL) {
-		perror("User Profile malloc");
-		exit(1);
-	}
-
-	// Now construct the string. strcat is safe here as we have counted the size of the strings already
-	// and we know they are null terminated. Properly using strncat here would mean keeping track of the remaining
-	// size of the buffer which is inefficient as we have already counted so strcat is used here instead.
-    // Add the name
-    snprintf(profile_str, str_size, "Name: %s\n\n", user->name);
-	strcat(profile_str, separator);
+    const char *profile = cached_profile(user);
+    size_t len = user->profile.len;
 
-    // Add the friend list.
-    strcat(profile_str, friends_list_header);
-    for (int i = 0; i < MAX_FRIENDS && user->friends[i] != NULL; i++) {
-        strcat(profile_str, user->friends[i]->name);
-		strcat(profile_str, "\n");
+    char *profile_str = malloc(len + 1);
+    if (profile_str == NULL) {
+        perror("User Profile malloc");
+        exit(1);
     }
-	strcat(profile_str, separator);
+    memcpy(profile_str, profile, len + 1);
+    return profile_str;
+}
 
-    // Add the post list.
-    strcat(profile_str, post_list_header);
-    curr = user->first_post;  // curr is first defined above when calculating the string size
-    while (curr != NULL) {
-        strcat(profile_str, print_post(curr));
-        curr = curr->next;
-        if (curr != NULL) {
-            strcat(profile_str, post_separator);
+
+/*
+ * Restore the heap property of the <len> entry max-heap of feed entries at <heap>, ordered by
+ * post date, for the subtree rooted at <i>.
+ */
+static void sift_down(FeedEntry *heap, unsigned int len, unsigned int i) {
+    FeedEntry entry = heap[i];
+    while (2 * i + 1 < len) {
+        unsigned int child = 2 * i + 1;
+        if (child + 1 < len && heap[child + 1].post->date > heap[child].post->date) {
+            child++;
+        }
+        if (heap[child].post->date <= entry.post->date) {
+            break;
         }
+        heap[i] = heap[child];
+        i = child;
     }
-	strcat(profile_str, separator);
+    heap[i] = entry;
+}
 
-	// profile_str should be null terminated from the last call to strcat but ensure this happens anyways
-	profile_str[str_size - 1] = '\0';
 
-	return profile_str;
+/*
+ * Append the <max_posts> newest posts on the walls of the friends of <user> to <buf>, newest
+ * first, each with the name of the user whose wall it is on. Every wall is already newest first,
+ * so the walls are merged with a heap holding the next post of each, and only the posts sent
+ * are visited. Friends' walls are read without their locks; <user> must not change meanwhile.
+ * <user> must not be NULL.
+ */
+void render_feed(const User *user, unsigned int max_posts, StrBuf *buf) {
+    unsigned int num_friends = user->friends.count;
+    FeedEntry *heap = malloc((num_friends > 0 ? num_friends : 1) * sizeof(FeedEntry));
+    if (heap == NULL) {
+        perror("feed malloc");
+        exit(1);
+    }
+    unsigned int len = 0;
+    for (unsigned int i = 0; i < num_friends; i++) {
+        const User *friend = user->friends.members[i];
+        const Post *first_post = __atomic_load_n(&friend->first_post, __ATOMIC_ACQUIRE);
+        if (first_post != NULL) {
+            heap[len].post = first_post;
+            heap[len].wall = friend;
+            len++;
+        }
+    }
+    for (unsigned int i = len / 2; i-- > 0;) {
+        sift_down(heap, len, i);
+    }
+
+    append_cstr(buf, "Feed:\n");
+    for (unsigned int num_posts = 0; num_posts < max_posts && len > 0; num_posts++) {
+        if (num_posts > 0) { // Only add the separator between posts
+            append_cstr(buf, "\n===\n\n");
+        }
+        append_str(buf, "To: ", 4);
+        append_cstr(buf, heap[0].wall->name);
+        append_str(buf, "\n", 1);
+        render_post(heap[0].post, buf);
+
+        // Replace the newest post with the next one on its wall, or drop the wall once it is used up.
+        heap[0].post = heap[0].post->next;
+        if (heap[0].post == NULL) {
+            heap[0] = heap[--len];
+        }
+        sift_down(heap, len, 0);
+    }
+    append_cstr(buf, PROFILE_SEPARATOR);
+    free(heap);
 }
 
 
 /*
- * Make a new post from 'author' to the 'target' user,
- * containing the given contents, IF the users are friends.
- *
- * Insert the new post at the *front* of the user's list of posts.
- *
- * Use the 'time' function to store the current time.
+ * Return a new uninitialized Post from the pool every post comes from.
+ */
+Post *alloc_post() {
+    return slab_alloc(&post_pool);
+}
+
+
+/*
+ * Add one to the count in <mutual> of every friend of <friend>. Call it for each friend of a
+ * user, then render_suggestions. Only the ids of <friend>'s friends are read, so <friend> must not
+ * change meanwhile but its friends are not touched.
+ */
+void count_mutual_friends(MutualCounts *mutual, const User *friend) {
+    const FriendSet *set = &friend->friends;
+    if (mutual->capacity < friend->table->count) {
+        // Room for a count for every user, the new ones starting at 0.
+        unsigned int new_capacity = friend->table->count;
+        unsigned int *counts = realloc(mutual->counts, new_capacity * sizeof(unsigned int));
+        if (counts == NULL) {
+            perror("mutual counts realloc");
+            exit(1);
+        }
+        memset(&counts[mutual->capacity], 0, (new_capacity - mutual->capacity) * sizeof(unsigned int));
+        mutual->counts = counts;
+        mutual->capacity = new_capacity;
+    }
+
+    for (unsigned int i = 0; i < set->count; i++) {
+        unsigned int id = set->ids[i];
+        if (mutual->counts[id]++ > 0) {
+            continue;
+        }
+        // First seen, so remember the user to rank and reset it later.
+        if (mutual->num_candidates == mutual->candidates_capacity) {
+            unsigned int new_capacity = mutual->candidates_capacity == 0 ? 64 : mutual->candidates_capacity * 2;
+            MutualCandidate *candidates = realloc(mutual->candidates, new_capacity * sizeof(MutualCandidate));
+            if (candidates == NULL) {
+                perror("mutual counts realloc");
+                exit(1);
+            }
+            mutual->candidates = candidates;
+            mutual->candidates_capacity = new_capacity;
+        }
+        mutual->candidates[mutual->num_candidates].user = set->members[i];
+        mutual->candidates[mutual->num_candidates].id = id;
+        mutual->num_candidates++;
+    }
+}
+
+
+/*
+ * Return 1 if the suggestion <a> ranks below <b>, with fewer mutual friends or, with as many,
+ * a newer user, and 0 otherwise.
+ */
+static int ranks_below(const Suggestion *a, const Suggestion *b) {
+    return a->count < b->count || (a->count == b->count && a->id > b->id);
+}
+
+
+/*
+ * Restore the heap property of the <len> entry min-heap of suggestions at <heap>, whose lowest
+ * ranked suggestion is at the root, for the subtree rooted at <i>.
+ */
+static void sift_down_suggestion(Suggestion *heap, unsigned int len, unsigned int i) {
+    Suggestion entry = heap[i];
+    while (2 * i + 1 < len) {
+        unsigned int child = 2 * i + 1;
+        if (child + 1 < len && ranks_below(&heap[child + 1], &heap[child])) {
+            child++;
+        }
+        if (!ranks_below(&heap[child], &entry)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = entry;
+}
+
+
+/*
+ * Append the <max_suggestions> users with the most mutual friends counted in <mutual> to <buf>,
+ * most first and the oldest user first among equal counts, leaving out <user> and its
+ * <num_friends> friends at <friends>. The top users are picked with a heap of <max_suggestions>
+ * entries, so ranking is linear in the number of candidates. Reset <mutual> for the next user.
+ */
+void render_suggestions(MutualCounts *mutual, const User *user, User *const *friends, unsigned int num_friends,
+                        unsigned int max_suggestions, StrBuf *buf) {
+    // Users that are already friends, and the user itself, are not suggested.
+    if (user->id < mutual->capacity) {
+        mutual->counts[user->id] = 0;
+    }
+    for (unsigned int i = 0; i < num_friends; i++) {
+        if (friends[i]->id < mutual->capacity) {
+            mutual->counts[friends[i]->id] = 0;
+        }
+    }
+
+    // Keep the best suggestions seen so far in a heap with the worst of them at the root.
+    unsigned int max_len = max_suggestions < mutual->num_candidates ? max_suggestions : mutual->num_candidates;
+    Suggestion *heap = malloc((max_len > 0 ? max_len : 1) * sizeof(Suggestion));
+    if (heap == NULL) {
+        perror("suggestions malloc");
+        exit(1);
+    }
+    unsigned int len = 0;
+    for (unsigned int i = 0; i < mutual->num_candidates; i++) {
+        Suggestion suggestion = {mutual->candidates[i].user, mutual->candidates[i].id,
+                                 mutual->counts[mutual->candidates[i].id]};
+        mutual->counts[suggestion.id] = 0;
+        if (suggestion.count == 0 || max_len == 0) {
+            continue;
+        }
+        if (len < max_len) {
+            // Sift the new suggestion up from the bottom of the heap.
+            unsigned int child = len++;
+            while (child > 0 && ranks_below(&suggestion, &heap[(child - 1) / 2])) {
+                heap[child] = heap[(child - 1) / 2];
+                child = (child - 1) / 2;
+            }
+            heap[child] = suggestion;
+        } else if (ranks_below(&heap[0], &suggestion)) {
+            heap[0] = suggestion;
+            sift_down_suggestion(heap, len, 0);
+        }
+    }
+    mutual->num_candidates = 0;
+
+    // Taking the root out each time leaves the best suggestions at the front of the array.
+    for (unsigned int end = len; end > 1; end--) {
+        Suggestion worst = heap[0];
+        heap[0] = heap[end - 1];
+        heap[end - 1] = worst;
+        sift_down_suggestion(heap, end - 1, 0);
+    }
+
+    append_cstr(buf, "Suggested friends:\n");
+    for (unsigned int i = 0; i < len; i++) {
+        char count[32];
+        snprintf(count, sizeof(count), ": %u mutual friend%s\n", heap[i].count, heap[i].count == 1 ? "" : "s");
+        append_cstr(buf, heap[i].user->name);
+        append_cstr(buf, count);
+    }
+    free(heap);
+}
+
+
+/*
+ * Add <post>, the newest post on the wall, to the end of <index>.
+ */
+static void index_post(PostIndex *index, Post *post) {
+    if (index->count == index->capacity) {
+        // Double the room for posts.
+        unsigned int new_capacity = index->capacity == 0 ? 4 : index->capacity * 2;
+        Post **posts = realloc(index->posts, new_capacity * sizeof(Post *));
+        if (posts == NULL) {
+            perror("post index realloc");
+            exit(1);
+        }
+        index->posts = posts;
+        index->capacity = new_capacity;
+    }
+    index->posts[index->count++] = post;
+}
+
+
+/*
+ * Rebuild the post index of <user> from its list of posts, for a user whose posts were
+ * added to the list directly rather than by make_post.
+ */
+void index_posts(User *user) {
+    PostIndex *index = &user->posts;
+    unsigned int count = 0;
+    for (const Post *curr = user->first_post; curr != NULL; curr = curr->next) {
+        count++;
+    }
+
+    // Sized exactly, since a wall restored this way is usually not about to grow.
+    free(index->posts);
+    index->posts = malloc((count > 0 ? count : 1) * sizeof(Post *));
+    if (index->posts == NULL) {
+        perror("post index malloc");
+        exit(1);
+    }
+    index->count = count;
+    index->capacity = count > 0 ? count : 1;
+    for (Post *curr = user->first_post; curr != NULL; curr = curr->next) {
+        index->posts[--count] = curr;
+    }
+}
+
+
+/*
+ * Add a post from 'author' with the <len> bytes at <contents>, made at <date>, to the front of
+ * the 'target' user's posts, IF the users are friends. Short contents are copied into the post.
+ * Long contents are kept in <heap_contents> if it is not NULL, in which case it must be
+ * <contents> itself, heap-allocated and null terminated; otherwise they are copied to the heap.
  *
- * 'contents' is a pointer to heap-allocated memory - you do not need
- * to allocate more memory to store the contents of the post.
+ * The post is complete before it is published, so render_feed, which reads other users' posts
+ * without their locks, never sees a post being filled in.
  *
  * Return:
  *   - 0 on success
  *   - 1 if users exist but are not friends
  *   - 2 if either User pointer is NULL
  */
-int make_post(const User *author, User *target, char *contents) {
+static int add_post(const User *author, User *target, const char *contents, size_t len,
+                    char *heap_contents, time_t date) {
     if (target == NULL || author == NULL) {
         return 2;
     }
 
-    int friends = 0;
-    for (int i = 0; i < MAX_FRIENDS && target->friends[i] != NULL; i++) {
-        if (strcmp(target->friends[i]->name, author->name) == 0) {
-            friends = 1;
-            break;
-        }
-    }
-
-    if (friends == 0) {
+    if (!is_friend(target, author)) {
         return 1;
     }
 
     // Create post
-    Post *new_post = malloc(sizeof(Post));
-    if (new_post == NULL) {
-        perror("malloc");
-        exit(1);
+    Post *post = alloc_post();
+    strncpy(post->author, author->name, MAX_NAME);
+    post->date = date;
+    if (len < POST_INLINE_CONTENTS) {
+        post->contents = post->inline_contents;
+    } else if (heap_contents != NULL) {
+        post->contents = heap_contents;
+    } else {
+        post->contents = malloc(len + 1);
+        if (post->contents == NULL) {
+            perror("malloc");
+            exit(1);
+        }
     }
-    strncpy(new_post->author, author->name, MAX_NAME);
-    new_post->contents = contents;
-    new_post->date = malloc(sizeof(time_t));
-    if (new_post->date == NULL) {
-        perror("malloc");
-        exit(1);
+    if (post->contents != heap_contents) {
+        memcpy(post->contents, contents, len);
+        post->contents[len] = '\0';
     }
-    time(new_post->date);
-    new_post->next = target->first_post;
-    target->first_post = new_post;
 
+    // Only now is it published, with a release store, and indexed.
+    post->next = target->first_post;
+    __atomic_store_n(&target->first_post, post, __ATOMIC_RELEASE);
+    index_post(&target->posts, post);
+    target->profile_valid = 0;
     return 0;
 }
 
+
+/*
+ * Make a new post from 'author' to the 'target' user,
+ * containing the given contents, IF the users are friends.
+ *
+ * Insert the new post at the *front* of the user's list of posts.
+ *
+ * Use the 'time' function to store the current time.
+ *
+ * 'contents' is a pointer to heap-allocated memory - you do not need
+ * to allocate more memory to store the contents of the post. On success the
+ * post takes ownership of it (short contents are copied into the post and freed).
+ *
+ * Return:
+ *   - 0 on success
+ *   - 1 if users exist but are not friends
+ *   - 2 if either User pointer is NULL
+ */
+int make_post(const User *author, User *target, char *contents) {
+    size_t len = strlen(contents);
+    int result = add_post(author, target, contents, len, contents, time(NULL));
+    if (result == 0 && len < POST_INLINE_CONTENTS) {
+        // The post has its own copy.
+        free(contents);
+    }
+    return result;
+}
+
+
+/*
+ * Make a new post like make_post, but copy its contents from the <len> bytes at
+ * <contents>, which do not need to be heap-allocated or null terminated.
+ *
+ * Return:
+ *   - 0 on success
+ *   - 1 if users exist but are not friends
+ *   - 2 if either User pointer is NULL
+ */
+int make_post_copy(const User *author, User *target, const char *contents, size_t len) {
+    return add_post(author, target, contents, len, NULL, time(NULL));
+}
+
+
+/*
+ * Make a new post like make_post_copy, but made at <date> rather than now.
+ *
+ * Return:
+ *   - 0 on success
+ *   - 1 if users exist but are not friends
+ *   - 2 if either User pointer is NULL
+ */
+int make_post_copy_at(const User *author, User *target, const char *contents, size_t len, time_t date) {
+    return add_post(author, target, contents, len, NULL, date);
+}
@@ -1,23 +1,111 @@
+#ifndef FRIENDS_H
+#define FRIENDS_H
+
+#include <stddef.h>
 #include <time.h>
 
 #define MAX_NAME 32     // Max username and profile_pic filename lengths
-#define MAX_FRIENDS 10  // Max number of friends a user can have
+#ifndef MAX_FRIENDS
+#define MAX_FRIENDS 0   // Max number of friends a user can have, 0 for no limit (build with -DMAX_FRIENDS=n)
+#endif
+#define FRIENDS_INLINE 4  // Friends stored inside the User before its friend set moves to the heap
+#define POST_INLINE_CONTENTS 40  // Posts shorter than this are stored inside the Post itself
+
+// A growable string. The first <len> bytes of <data> are in use and are followed by a null terminator.
+// Start with {NULL, 0, 0}; the owner frees <data>.
+typedef struct str_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+// An index over the list of users that lives next to it. Every user in a list created with
+// create_user points to the same table so the list's head is enough to find it.
+// The table uses open addressing with linear probing, keyed on the user's name.
+typedef struct user_table {
+    struct user **slots;    // capacity slots, NULL for an empty slot
+    unsigned int capacity;  // Always a power of two
+    unsigned int count;     // Number of users in the table
+    struct user *head;
+    struct user *tail;      // Last user in the list so new users are appended in O(1)
+    StrBuf user_list;       // The listing returned by list_users, appended to by create_user
+} UserTable;
+
+// The friends of a user. members lists them in the order they were added, starting in
+// inline_members and moving to the heap when there are more than FRIENDS_INLINE. Once a set
+// outgrows its inline storage it also keeps <index>, an open addressing hash set of the members'
+// pointers, so membership checks stay O(1) however many friends a user has. <ids> holds the id of
+// each member in the same order, so the graph can be walked without touching the friends' Users.
+typedef struct friend_set {
+    unsigned int count;
+    unsigned int capacity;         // Size of members and ids
+    struct user **members;
+    unsigned int *ids;
+    struct user **index;           // index_capacity slots, NULL for an empty slot, or NULL while inline
+    unsigned int index_capacity;   // Always a power of two
+    struct user *inline_members[FRIENDS_INLINE];
+    unsigned int inline_ids[FRIENDS_INLINE];
+} FriendSet;
+
+// The posts on a user's wall, oldest first, alongside the newest first list that starts at the
+// user's first_post. Any page of the wall is found by position without walking the list, and
+// posts are added in date order, so the posts since a time are found by binary search.
+typedef struct post_index {
+    struct post **posts;    // capacity entries, the first count in use
+    unsigned int count;
+    unsigned int capacity;
+} PostIndex;
 
 typedef struct user {
     char name[MAX_NAME];
+    unsigned int id;  // Position of the user in its list, starting at 0
     char profile_pic[MAX_NAME];  // This is a *filename*, not the file contents.
     struct post *first_post;
-    struct user *friends[MAX_FRIENDS];
+    PostIndex posts;
+    FriendSet friends;
     struct user *next;
+    struct user_table *table;
+    struct client_connection *first_session;  // Connections logged in as this user (used by friend_server)
+    StrBuf profile;     // The rendered profile, only up to date while profile_valid is set
+    int profile_valid;  // Cleared by make_post and make_friends when the profile changes
 } User;
 
+// Users and posts are allocated from slab pools and are never freed.
 typedef struct post {
     char author[MAX_NAME];
-    char *contents;
-    time_t *date;
+    char *contents;  // Points to inline_contents for short posts
+    time_t date;
     struct post *next;
+    char inline_contents[POST_INLINE_CONTENTS];
 } Post;
 
+// A user's profile as it was at one moment, which can be rendered without the user staying the
+// same. Posts are never changed once added, so the list starting at <first_post> never changes;
+// <friends> is a copy of the user's friends. Taken with cached_profile_or_view.
+typedef struct profile_view {
+    const User *user;
+    const Post *first_post;
+    User **friends;
+    unsigned int num_friends;
+} ProfileView;
+
+// One user seen two hops away from a user while counting mutual friends.
+typedef struct mutual_candidate {
+    struct user *user;
+    unsigned int id;
+} MutualCandidate;
+
+// The number of mutual friends each user shares with one user, gathered one friend at a time by
+// count_mutual_friends and ranked by render_suggestions. Start with {NULL, 0, NULL, 0, 0}; the
+// arrays are kept between uses so each thread can reuse one.
+typedef struct mutual_counts {
+    unsigned int *counts;            // Indexed by user id, 0 for users not seen
+    unsigned int capacity;           // Size of counts
+    MutualCandidate *candidates;     // The users with a non-zero count, in the order they were seen
+    unsigned int num_candidates;
+    unsigned int candidates_capacity;
+} MutualCounts;
+
 
 /*
  * Create a new user with the given name.  Insert it at the tail of the list
@@ -32,9 +120,17 @@ typedef struct post {
 int create_user(const char *name, User **user_ptr_add);
 
 
+/*
+ * Make room in the index of the list starting at <head>, which must not be empty, for <num_users>
+ * users in total, so creating that many users never has to rehash it.
+ */
+void reserve_users(User *head, unsigned int num_users);
+
+
 /*
  * Return a pointer to the user with this name in
  * the list starting with head. Return NULL if no such user exists.
+ * <head> must be the head of a list built with create_user (or NULL).
  *
  * NOTE: You'll likely need to cast a (const User *) to a (User *)
  * to satisfy the prototype without warnings.
@@ -49,18 +145,27 @@ User *find_user(const char *name, const User *head);
 char *list_users(const User *curr);
 
 
+/*
+ * Return the usernames of all users in the list starting at <head>, in the format
+ * returned by list_users, without copying it.
+ * The listing is maintained by create_user, so the string is only valid until the next
+ * user is created. <head> must be the head of a list built with create_user (or NULL).
+ */
+const char *cached_user_list(const User *head);
+
+
 
 /*
  * Make two users friends with each other.  This is symmetric - a pointer to
- * each user must be stored in the 'friends' array of the other.
+ * each user must be stored in the 'friends' set of the other.
  *
- * New friends must be added in the first empty spot in the 'friends' array.
+ * New friends are added at the end of the 'friends' set.
  *
  * Return:
  *   - 0 on success.
  *   - 1 if the two users are already friends.
  *   - 2 if the users are not already friends, but at least one already has
- *     MAX_FRIENDS friends.
+ *     MAX_FRIENDS friends (never when MAX_FRIENDS is 0).
  *   - 3 if the same user is passed in twice.
  *   - 4 if at least one user does not exist.
  *
@@ -70,6 +175,27 @@ char *list_users(const User *curr);
 int make_friends(const char *name1, const char *name2, User *head);
 
 
+/*
+ * Return 1 if <friend> is in the friends of <user> and 0 otherwise.
+ */
+int is_friend(const User *user, const User *friend);
+
+
+/*
+ * Add <friend>, which must not already be in the set, to the end of <set>.
+ * This only changes one side of the friendship; make_friends adds both.
+ * Used to restore friendships that are already known to be valid (see snapshot.c).
+ */
+void add_friend(FriendSet *set, User *friend);
+
+
+/*
+ * Return a new uninitialized Post from the pool every post comes from.
+ * Used to restore posts that are already known to be valid (see snapshot.c).
+ */
+Post *alloc_post();
+
+
 /*
  * Return a string representing the post <post>.
  * For an example of the required output format, see the example output
@@ -79,6 +205,129 @@ int make_friends(const char *name1, const char *name2, User *head);
 char *print_user(const User *user);
 
 
+/*
+ * Return the string representing a user profile, in the format returned by print_user.
+ * The profile is rendered once and cached in the user until a post or friend is added to it,
+ * so the string is only valid until the next call to make_post or make_friends for this user.
+ * <user> must not be NULL.
+ */
+const char *cached_profile(const User *user);
+
+
+/*
+ * Return the profile of <user> if its cache is up to date, counting a hit, like cached_profile.
+ * Otherwise count a miss, set <view> to a view of the user for render_profile_view and return NULL.
+ * <user> must not be NULL.
+ */
+const char *cached_profile_or_view(const User *user, ProfileView *view);
+
+
+/*
+ * Append the profile of the user as it was when <view> was taken to <buf>, in the format
+ * returned by print_user. The user does not need to be locked, so this can run on another thread
+ * while the user changes.
+ */
+void render_profile_view(const ProfileView *view, StrBuf *buf);
+
+
+/*
+ * Store the <len> byte profile at <profile>, rendered from <view>, as the cached profile of the
+ * view's user if the user has not changed since the view was taken.
+ * Return 1 if the profile was cached and 0 if it is already out of date.
+ */
+int cache_profile_view(const ProfileView *view, const char *profile, size_t len);
+
+
+/*
+ * Free the memory held by <view>.
+ */
+void free_profile_view(ProfileView *view);
+
+
+/*
+ * Set <hits> and <misses> to the number of times cached_profile (or print_user) found the user's
+ * profile in the cache and the number of times it had to render it.
+ */
+void profile_cache_stats(unsigned long *hits, unsigned long *misses);
+
+
+/*
+ * Ensure <buf> has room for <len> more bytes plus a null terminator.
+ */
+void reserve_str(StrBuf *buf, size_t len);
+
+
+/*
+ * Append the <len> bytes at <str> to <buf>, keeping it null terminated.
+ */
+void append_str(StrBuf *buf, const char *str, size_t len);
+
+
+/*
+ * Append the null terminated string <str> to <buf>.
+ */
+void append_cstr(StrBuf *buf, const char *str);
+
+
+/*
+ * Append the string representing a user profile to <buf> in a single pass.
+ * This is the format returned by print_user.
+ * <user> must not be NULL.
+ */
+void render_user(const User *user, StrBuf *buf);
+
+
+/*
+ * Append the profile of <user> to <buf> in the format returned by print_user, but with only
+ * <limit> of its posts, starting <offset> posts from the newest. Only the posts on the page are
+ * visited. <user> must not be NULL.
+ */
+void render_profile_page(const User *user, unsigned int offset, unsigned int limit, StrBuf *buf);
+
+
+/*
+ * Append the posts on the wall of <user> made at or after <since>, newest first, to <buf>.
+ * The oldest of them is found by binary search, so only the posts sent are visited.
+ * <user> must not be NULL.
+ */
+void render_posts_since(const User *user, time_t since, StrBuf *buf);
+
+
+/*
+ * Rebuild the post index of <user> from its list of posts, for a user whose posts were
+ * added to the list directly rather than by make_post.
+ */
+void index_posts(User *user);
+
+
+/*
+ * Append the <max_posts> newest posts on the walls of the friends of <user> to <buf>, newest
+ * first, each with the name of the user whose wall it is on. Every wall is already newest first,
+ * so the walls are merged with a heap holding the next post of each, and only the posts sent
+ * are visited. Friends' walls are read without their locks; <user> must not change meanwhile.
+ * <user> must not be NULL.
+ */
+void render_feed(const User *user, unsigned int max_posts, StrBuf *buf);
+
+
+/*
+ * Add one to the count in <mutual> of every friend of <friend>. Call it for each friend of a
+ * user, then render_suggestions. Only the ids of <friend>'s friends are read, so <friend> must not
+ * change meanwhile but its friends are not touched.
+ */
+void count_mutual_friends(MutualCounts *mutual, const User *friend);
+
+
+/*
+ * Append the <max_suggestions> users with the most mutual friends counted in <mutual> to <buf>,
+ * most first and the oldest user first among equal counts, leaving out <user> and its
+ * <num_friends> friends at <friends>. The top users are picked with a heap of <max_suggestions>
+ * entries, so ranking is linear in the number of candidates. Reset <mutual> for the next user.
+ */
+void render_suggestions(MutualCounts *mutual, const User *user, User *const *friends, unsigned int num_friends,
+                        unsigned int max_suggestions, StrBuf *buf);
+
+
 /*
  * Make a new post from 'author' to the 'target' user,
  * containing the given contents, IF the users are friends.
@@ -88,7 +337,8 @@ char *print_user(const User *user);
  * Use the 'time' function to store the current time.
  *
  * 'contents' is a pointer to heap-allocated memory - you do not need
- * to allocate more memory to store the contents of the post.
+ * to allocate more memory to store the contents of the post. On success the
+ * post takes ownership of it (short contents are copied into the post and freed).
  *
  * Return:
  *   - 0 on success
@@ -98,3 +348,26 @@ char *print_user(const User *user);
 int make_post(const User *author, User *target, char *contents);
 
 
+/*
+ * Make a new post like make_post, but copy its contents from the <len> bytes at
+ * <contents>, which do not need to be heap-allocated or null terminated.
+ *
+ * Return:
+ *   - 0 on success
+ *   - 1 if users exist but are not friends
+ *   - 2 if either User pointer is NULL
+ */
+int make_post_copy(const User *author, User *target, const char *contents, size_t len);
+
+
+/*
+ * Make a new post like make_post_copy, but made at <date> rather than now.
+ *
+ * Return:
+ *   - 0 on success
+ *   - 1 if users exist but are not friends
+ *   - 2 if either User pointer is NULL
+ */
+int make_post_copy_at(const User *author, User *target, const char *contents, size_t len, time_t date);
+
+#endif
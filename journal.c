@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+#define RECORD_HEADER_SIZE 8  // Payload length and checksum
+
+#define RECORD_CREATE_USER 'U'
+#define RECORD_MAKE_FRIENDS 'F'
+#define RECORD_MAKE_POST 'P'
+
+
+/*
+ * Parse <name> ("none", "batched" or "per-op") into <durability>.
+ * Return 0 on success or -1 if <name> is not a durability mode.
+ */
+int parse_durability(const char *name, Durability *durability) {
+    if (strcmp(name, "none") == 0) {
+        *durability = DURABILITY_NONE;
+    } else if (strcmp(name, "batched") == 0) {
+        *durability = DURABILITY_BATCHED;
+    } else if (strcmp(name, "per-op") == 0) {
+        *durability = DURABILITY_PER_OP;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Return the FNV-1a checksum of the <len> bytes at <data>.
+ */
+static uint32_t checksum(const char *data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/*
+ * Start a record in the pending buffer of <journal>, leaving room for its header.
+ * Return the offset of the record in the pending buffer.
+ */
+static size_t begin_record(Journal *journal, char type) {
+    size_t start = journal->pending.len;
+    char header[RECORD_HEADER_SIZE] = {0};
+    append_str(&journal->pending, header, RECORD_HEADER_SIZE);
+    append_str(&journal->pending, &type, 1);
+    return start;
+}
+
+
+/*
+ * Append a string field, prefixed with its length in <len_size> bytes, to the pending buffer of <journal>.
+ */
+static void add_field(Journal *journal, const char *str, uint32_t len, size_t len_size) {
+    if (len_size == 2) {
+        uint16_t short_len = len;
+        append_str(&journal->pending, (const char *)&short_len, 2);
+    } else {
+        append_str(&journal->pending, (const char *)&len, 4);
+    }
+    append_str(&journal->pending, str, len);
+}
+
+
+/*
+ * Write <len> bytes at <data> to <fd>, exiting the program if they cannot be written.
+ */
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t num_wrote = write(fd, data, len);
+        if (num_wrote == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("journal: write");
+            exit(1);
+        }
+        data += num_wrote;
+        len -= num_wrote;
+    }
+}
+
+
+/*
+ * Fill in the header of the record starting at <start> in the pending buffer of <journal>.
+ * In per-op mode the record is written and forced to disk immediately.
+ */
+static void end_record(Journal *journal, size_t start) {
+    char *record = &journal->pending.data[start];
+    uint32_t payload_len = journal->pending.len - start - RECORD_HEADER_SIZE;
+    uint32_t payload_checksum = checksum(&record[RECORD_HEADER_SIZE], payload_len);
+    memcpy(record, &payload_len, 4);
+    memcpy(&record[4], &payload_checksum, 4);
+
+    if (journal->durability == DURABILITY_PER_OP) {
+        write_all(journal->fd, journal->pending.data, journal->pending.len);
+        journal->size += journal->pending.len;
+        journal->pending.len = 0;
+        if (fdatasync(journal->fd) == -1) {
+            perror("journal: fdatasync");
+            exit(1);
+        }
+    }
+}
+
+
+/*
+ * Record that a user named <name> was created.
+ */
+void journal_create_user(Journal *journal, const char *name) {
+    pthread_mutex_lock(&journal->lock);
+    size_t start = begin_record(journal, RECORD_CREATE_USER);
+    add_field(journal, name, strlen(name), 2);
+    end_record(journal, start);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+
+/*
+ * Record that the users named <name1> and <name2> became friends.
+ */
+void journal_make_friends(Journal *journal, const char *name1, const char *name2) {
+    pthread_mutex_lock(&journal->lock);
+    size_t start = begin_record(journal, RECORD_MAKE_FRIENDS);
+    add_field(journal, name1, strlen(name1), 2);
+    add_field(journal, name2, strlen(name2), 2);
+    end_record(journal, start);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+
+/*
+ * Record that <post>, the newest post of the user named <target>, was made.
+ */
+void journal_make_post(Journal *journal, const char *target, const Post *post) {
+    pthread_mutex_lock(&journal->lock);
+    size_t start = begin_record(journal, RECORD_MAKE_POST);
+    add_field(journal, post->author, strlen(post->author), 2);
+    add_field(journal, target, strlen(target), 2);
+    int64_t date = post->date;
+    append_str(&journal->pending, (const char *)&date, 8);
+    add_field(journal, post->contents, strlen(post->contents), 4);
+    end_record(journal, start);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+
+/*
+ * Write every pending record and, in batched mode, force them to disk.
+ * Exits the program if the journal cannot be written.
+ */
+void journal_commit(Journal *journal) {
+    pthread_mutex_lock(&journal->lock);
+    if (journal->pending.len > 0) {
+        write_all(journal->fd, journal->pending.data, journal->pending.len);
+        journal->size += journal->pending.len;
+        journal->pending.len = 0;
+        if (journal->durability == DURABILITY_BATCHED && fdatasync(journal->fd) == -1) {
+            perror("journal: fdatasync");
+            exit(1);
+        }
+    }
+    pthread_mutex_unlock(&journal->lock);
+}
+
+
+/*
+ * Read a string field with a <len_size> byte length from the <len> bytes at *<pos>, advancing *<pos>.
+ * Set *<str> to its bytes and *<str_len> to its length.
+ * Return 0 on success or -1 if the field runs past the end.
+ */
+static int read_field(const char **pos, const char *end, size_t len_size, const char **str, uint32_t *str_len) {
+    if (end - *pos < len_size) {
+        return -1;
+    }
+    if (len_size == 2) {
+        uint16_t short_len;
+        memcpy(&short_len, *pos, 2);
+        *str_len = short_len;
+    } else {
+        memcpy(str_len, *pos, 4);
+    }
+    *pos += len_size;
+    if (end - *pos < *str_len) {
+        return -1;
+    }
+    *str = *pos;
+    *pos += *str_len;
+    return 0;
+}
+
+
+/*
+ * Read a name field from *<pos> into <name>, advancing *<pos>.
+ * Return 0 on success or -1 if the field is malformed.
+ */
+static int read_name(const char **pos, const char *end, char *name) {
+    const char *str;
+    uint32_t len;
+    if (read_field(pos, end, 2, &str, &len) == -1 || len >= MAX_NAME) {
+        return -1;
+    }
+    memcpy(name, str, len);
+    name[len] = '\0';
+    return 0;
+}
+
+
+/*
+ * Apply the record <payload> of <len> bytes to the list of users whose head is pointed to by *user_ptr_add.
+ * Return 0 on success or -1 if the record is malformed.
+ */
+static int apply_record(const char *payload, size_t len, User **user_ptr_add) {
+    const char *pos = &payload[1];
+    const char *end = &payload[len];
+    char name1[MAX_NAME];
+    char name2[MAX_NAME];
+
+    if (len < 1) {
+        return -1;
+    }
+    switch (payload[0]) {
+        case RECORD_CREATE_USER:
+            if (read_name(&pos, end, name1) == -1) {
+                return -1;
+            }
+            create_user(name1, user_ptr_add);
+            return 0;
+        case RECORD_MAKE_FRIENDS:
+            if (read_name(&pos, end, name1) == -1 || read_name(&pos, end, name2) == -1) {
+                return -1;
+            }
+            make_friends(name1, name2, *user_ptr_add);
+            return 0;
+        case RECORD_MAKE_POST: {
+            int64_t date;
+            const char *contents;
+            uint32_t contents_len;
+            if (read_name(&pos, end, name1) == -1 || read_name(&pos, end, name2) == -1 || end - pos < 8) {
+                return -1;
+            }
+            memcpy(&date, pos, 8);
+            pos += 8;
+            if (read_field(&pos, end, 4, &contents, &contents_len) == -1) {
+                return -1;
+            }
+
+            // Keep the time the post was originally made.
+            make_post_copy_at(find_user(name1, *user_ptr_add), find_user(name2, *user_ptr_add), contents,
+                              contents_len, date);
+            return 0;
+        }
+        default:
+            return -1;
+    }
+}
+
+
+/*
+ * Replay the records from offset <replay_from> onward in the journal at <path> onto the list of users
+ * whose head is pointed to by *user_ptr_add, then open it so new records are appended after the last
+ * complete record. The records before <replay_from> must already be reflected in the list (they were
+ * loaded from a snapshot).
+ * A torn or corrupt record at the end (from a crash in the middle of a write) is discarded.
+ * Return the number of records replayed, or -1 if the journal could not be opened.
+ */
+long journal_open(Journal *journal, const char *path, Durability durability, off_t replay_from,
+                  User **user_ptr_add) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("journal: open");
+        return -1;
+    }
+
+    // Read the whole journal into memory.
+    StrBuf contents = {NULL, 0, 0};
+    char buf[1 << 16];
+    ssize_t num_read;
+    while ((num_read = read(fd, buf, sizeof(buf))) != 0) {
+        if (num_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("journal: read");
+            close(fd);
+            free(contents.data);
+            return -1;
+        }
+        append_str(&contents, buf, num_read);
+    }
+
+    if (replay_from > contents.len) {
+        fprintf(stderr, "[Server] Journal %s is shorter than the snapshot expects, replaying none of it\n", path);
+        replay_from = contents.len;
+    }
+
+    long num_records = 0;
+    size_t valid_len = replay_from;
+    while (contents.len - valid_len >= RECORD_HEADER_SIZE) {
+        const char *record = &contents.data[valid_len];
+        uint32_t payload_len;
+        uint32_t payload_checksum;
+        memcpy(&payload_len, record, 4);
+        memcpy(&payload_checksum, &record[4], 4);
+        if (contents.len - valid_len - RECORD_HEADER_SIZE < payload_len
+            || checksum(&record[RECORD_HEADER_SIZE], payload_len) != payload_checksum
+            || apply_record(&record[RECORD_HEADER_SIZE], payload_len, user_ptr_add) == -1) {
+            break;
+        }
+        valid_len += RECORD_HEADER_SIZE + payload_len;
+        num_records++;
+    }
+
+    if (valid_len < contents.len) {
+        fprintf(stderr, "[Server] Discarding %zu bytes of torn journal records\n", contents.len - valid_len);
+        if (ftruncate(fd, valid_len) == -1) {
+            perror("journal: ftruncate");
+            close(fd);
+            free(contents.data);
+            return -1;
+        }
+    }
+    free(contents.data);
+
+    if (lseek(fd, valid_len, SEEK_SET) == -1) {
+        perror("journal: lseek");
+        close(fd);
+        return -1;
+    }
+
+    journal->fd = fd;
+    journal->durability = durability;
+    journal->size = valid_len;
+    journal->pending.data = NULL;
+    journal->pending.len = 0;
+    journal->pending.cap = 0;
+    pthread_mutex_init(&journal->lock, NULL);
+    return num_records;
+}
@@ -0,0 +1,77 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "friends.h"
+
+// When the journal forces its records to disk with fdatasync.
+typedef enum {
+    DURABILITY_NONE,     // Never; records reach the disk whenever the OS writes them back
+    DURABILITY_BATCHED,  // Once per journal_commit, for every record added since the last one
+    DURABILITY_PER_OP    // After every record, before the operation is acknowledged
+} Durability;
+
+// An append-only log of every create_user, make_friends and make_post, so the users, friendships
+// and posts can be rebuilt by replaying it. Records are collected in <pending> and written with a
+// single write (and, in batched mode, a single fdatasync) by journal_commit, which the server calls
+// once per event loop pass.
+//
+// Each record is a 4 byte payload length, a 4 byte FNV-1a checksum of the payload, then the payload:
+// a type byte followed by the fields of the operation. Strings are a 2 byte length (4 for post
+// contents) followed by their bytes, and post dates are 8 bytes. Integers are in host byte order.
+// Records may be added and committed from several threads; <lock> guards <pending> and the file.
+typedef struct journal {
+    int fd;
+    Durability durability;
+    off_t size;           // Bytes of complete records written to the file
+    StrBuf pending;       // Records that have not been written yet
+    pthread_mutex_t lock;
+} Journal;
+
+
+/*
+ * Parse <name> ("none", "batched" or "per-op") into <durability>.
+ * Return 0 on success or -1 if <name> is not a durability mode.
+ */
+int parse_durability(const char *name, Durability *durability);
+
+
+/*
+ * Replay the records from offset <replay_from> onward in the journal at <path> onto the list of users
+ * whose head is pointed to by *user_ptr_add, then open it so new records are appended after the last
+ * complete record. The records before <replay_from> must already be reflected in the list (they were
+ * loaded from a snapshot).
+ * A torn or corrupt record at the end (from a crash in the middle of a write) is discarded.
+ * Return the number of records replayed, or -1 if the journal could not be opened.
+ */
+long journal_open(Journal *journal, const char *path, Durability durability, off_t replay_from,
+                  User **user_ptr_add);
+
+
+/*
+ * Record that a user named <name> was created.
+ */
+void journal_create_user(Journal *journal, const char *name);
+
+
+/*
+ * Record that the users named <name1> and <name2> became friends.
+ */
+void journal_make_friends(Journal *journal, const char *name1, const char *name2);
+
+
+/*
+ * Record that <post>, the newest post of the user named <target>, was made.
+ */
+void journal_make_post(Journal *journal, const char *target, const Post *post);
+
+
+/*
+ * Write every pending record and, in batched mode, force them to disk.
+ * Exits the program if the journal cannot be written.
+ */
+void journal_commit(Journal *journal);
+
+#endif
@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include "locks.h"
+
+static pthread_rwlock_t users_lock;
+static pthread_mutex_t user_locks[USER_LOCK_STRIPES];
+
+
+/*
+ * Return the mutex guarding <user>.
+ */
+static pthread_mutex_t *user_lock(const User *user) {
+    return &user_locks[user->id & (USER_LOCK_STRIPES - 1)];
+}
+
+
+/*
+ * Initialize the locks. Must be called before any other thread starts.
+ */
+void init_locks() {
+    // Commands hold the users lock shared almost all the time, so prefer writers or a new user
+    // could wait for a moment when no command is running.
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&users_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    for (int i = 0; i < USER_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&user_locks[i], NULL);
+    }
+}
+
+
+/*
+ * Lock the list of users, shared when <exclusive> is 0, to read it, or exclusively to change it.
+ */
+void lock_users(int exclusive) {
+    if (exclusive) {
+        pthread_rwlock_wrlock(&users_lock);
+    } else {
+        pthread_rwlock_rdlock(&users_lock);
+    }
+}
+
+
+/*
+ * Unlock the list of users.
+ */
+void unlock_users() {
+    pthread_rwlock_unlock(&users_lock);
+}
+
+
+/*
+ * Lock the posts, friends, cached profile and sessions of <user>.
+ */
+void lock_user(const User *user) {
+    pthread_mutex_lock(user_lock(user));
+}
+
+
+/*
+ * Unlock the posts, friends, cached profile and sessions of <user>.
+ */
+void unlock_user(const User *user) {
+    pthread_mutex_unlock(user_lock(user));
+}
+
+
+/*
+ * Lock both <user1> and <user2>, either of which may be NULL or the same user, without
+ * deadlocking with another thread locking the same pair.
+ */
+void lock_user_pair(const User *user1, const User *user2) {
+    pthread_mutex_t *lock1 = user1 == NULL ? NULL : user_lock(user1);
+    pthread_mutex_t *lock2 = user2 == NULL ? NULL : user_lock(user2);
+    // Two users can share a stripe; it is only locked once. Otherwise the lower stripe goes first.
+    if (lock1 == lock2) {
+        lock2 = NULL;
+    } else if (lock1 != NULL && lock2 != NULL && lock2 < lock1) {
+        pthread_mutex_t *first = lock2;
+        lock2 = lock1;
+        lock1 = first;
+    }
+    if (lock1 != NULL) {
+        pthread_mutex_lock(lock1);
+    }
+    if (lock2 != NULL) {
+        pthread_mutex_lock(lock2);
+    }
+}
+
+
+/*
+ * Unlock the users locked by lock_user_pair(<user1>, <user2>).
+ */
+void unlock_user_pair(const User *user1, const User *user2) {
+    pthread_mutex_t *lock1 = user1 == NULL ? NULL : user_lock(user1);
+    pthread_mutex_t *lock2 = user2 == NULL ? NULL : user_lock(user2);
+    if (lock1 != NULL) {
+        pthread_mutex_unlock(lock1);
+    }
+    if (lock2 != NULL && lock2 != lock1) {
+        pthread_mutex_unlock(lock2);
+    }
+}
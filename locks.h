@@ -0,0 +1,60 @@
+#ifndef LOCKS_H
+#define LOCKS_H
+
+#include "friends.h"
+
+#define USER_LOCK_STRIPES 256  // Number of mutexes the users are spread over, a power of two
+
+// The locks friend_server's worker threads use to share the users.
+//
+// The list of users (its index, listing and head) is guarded by a reader-writer lock: every
+// command holds it shared, and only creating a user or taking a snapshot holds it exclusively.
+// A user's posts, friends, cached profile and sessions are guarded by one of USER_LOCK_STRIPES
+// mutexes picked by the user's id, so commands on different users rarely contend.
+// The users lock is always taken before a user lock, and two user locks are taken with
+// lock_user_pair, so the locks are always taken in the same order.
+
+
+/*
+ * Initialize the locks. Must be called before any other thread starts.
+ */
+void init_locks();
+
+
+/*
+ * Lock the list of users, shared when <exclusive> is 0, to read it, or exclusively to change it.
+ */
+void lock_users(int exclusive);
+
+
+/*
+ * Unlock the list of users.
+ */
+void unlock_users();
+
+
+/*
+ * Lock the posts, friends, cached profile and sessions of <user>.
+ */
+void lock_user(const User *user);
+
+
+/*
+ * Unlock the posts, friends, cached profile and sessions of <user>.
+ */
+void unlock_user(const User *user);
+
+
+/*
+ * Lock both <user1> and <user2>, either of which may be NULL or the same user, without
+ * deadlocking with another thread locking the same pair.
+ */
+void lock_user_pair(const User *user1, const User *user2);
+
+
+/*
+ * Unlock the users locked by lock_user_pair(<user1>, <user2>).
+ */
+void unlock_user_pair(const User *user1, const User *user2);
+
+#endif
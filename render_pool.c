@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "render_pool.h"
+#include "locks.h"
+
+// A profile waiting to be rendered, and the client it is for.
+typedef struct render_job {
+    struct render_job *next;
+    ProfileView view;
+    ClientTable *owner;
+    int sock_fd;
+    unsigned long serial;
+} RenderJob;
+
+// The jobs waiting for a render thread, oldest first. Guarded by queue_lock.
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static RenderJob *queue_head = NULL;
+static RenderJob *queue_tail = NULL;
+static unsigned long queue_length = 0;
+
+
+/*
+ * Take the oldest job from the queue, waiting for one if it is empty.
+ */
+static RenderJob *next_job() {
+    pthread_mutex_lock(&queue_lock);
+    while (queue_head == NULL) {
+        pthread_cond_wait(&queue_ready, &queue_lock);
+    }
+    RenderJob *job = queue_head;
+    queue_head = job->next;
+    if (queue_head == NULL) {
+        queue_tail = NULL;
+    }
+    queue_length--;
+    pthread_mutex_unlock(&queue_lock);
+    return job;
+}
+
+
+/*
+ * Render jobs forever.
+ */
+static void *run_renderer(void *arg) {
+    while (1) {
+        RenderJob *job = next_job();
+        StrBuf profile = {NULL, 0, 0};
+        render_profile_view(&job->view, &profile);
+
+        // Keep the render so the next request for the profile is a cache hit.
+        lock_user(job->view.user);
+        cache_profile_view(&job->view, profile.data, profile.len);
+        unlock_user(job->view.user);
+
+        post_mail(job->owner, job->sock_fd, job->serial, profile.data);
+        free_profile_view(&job->view);
+        free(job);
+    }
+    return NULL;
+}
+
+
+/*
+ * Start <num_threads> render threads.
+ */
+void start_render_pool(int num_threads) {
+    for (int i = 0; i < num_threads; i++) {
+        pthread_t thread;
+        int error = pthread_create(&thread, NULL, run_renderer, NULL);
+        if (error != 0) {
+            fprintf(stderr, "render pool: pthread_create: %s\n", strerror(error));
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+}
+
+
+/*
+ * Render the profile in <view> on a render thread and send it to <client>. The pool takes
+ * ownership of <view>. <client>'s table must have a mailbox eventfd.
+ */
+void render_profile_for(ProfileView *view, const Client *client) {
+    RenderJob *job = malloc(sizeof(RenderJob));
+    if (job == NULL) {
+        perror("render job malloc");
+        exit(1);
+    }
+    job->next = NULL;
+    job->view = *view;
+    job->owner = client->table;
+    job->sock_fd = client->sock_fd;
+    job->serial = client->serial;
+
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail != NULL) {
+        queue_tail->next = job;
+    } else {
+        queue_head = job;
+    }
+    queue_tail = job;
+    queue_length++;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+
+/*
+ * Return the number of profiles waiting for a render thread.
+ */
+unsigned long render_queue_length() {
+    pthread_mutex_lock(&queue_lock);
+    unsigned long length = queue_length;
+    pthread_mutex_unlock(&queue_lock);
+    return length;
+}
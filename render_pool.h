@@ -0,0 +1,31 @@
+#ifndef RENDER_POOL_H
+#define RENDER_POOL_H
+
+#include "friends.h"
+#include "client.h"
+
+// A pool of threads that render profiles off the event loop. A worker takes a ProfileView of a
+// user whose cached profile is out of date and hands it to the pool with the client that asked
+// for it; a render thread renders the view, caches it in the user if the user has not changed
+// since, and sends the rendered profile to the client through its worker's mailbox.
+
+
+/*
+ * Start <num_threads> render threads.
+ */
+void start_render_pool(int num_threads);
+
+
+/*
+ * Render the profile in <view> on a render thread and send it to <client>. The pool takes
+ * ownership of <view>. <client>'s table must have a mailbox eventfd.
+ */
+void render_profile_for(ProfileView *view, const Client *client);
+
+
+/*
+ * Return the number of profiles waiting for a render thread.
+ */
+unsigned long render_queue_length();
+
+#endif
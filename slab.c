@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "slab.h"
+
+
+/*
+ * Return a pointer to an uninitialized object from <pool>.
+ * Exits the program if no memory is available.
+ */
+void *slab_alloc(SlabPool *pool) {
+    if (pool->free_list != NULL) {
+        void *obj = pool->free_list;
+        pool->free_list = *(void **)obj;
+        return obj;
+    }
+
+    if (pool->next == NULL || pool->next + pool->obj_size > pool->end) {
+        // The current slab is used up so start a new one. Objects bigger than a slab get a slab each.
+        size_t slab_size = pool->obj_size > SLAB_SIZE ? pool->obj_size : SLAB_SIZE;
+        pool->next = malloc(slab_size);
+        if (pool->next == NULL) {
+            perror("slab malloc");
+            exit(1);
+        }
+        pool->end = pool->next + slab_size;
+    }
+
+    void *obj = pool->next;
+    pool->next += pool->obj_size;
+    return obj;
+}
+
+
+/*
+ * Return the object <obj>, which must have come from slab_alloc on <pool>, to <pool>.
+ */
+void slab_free(SlabPool *pool, void *obj) {
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+}
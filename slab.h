@@ -0,0 +1,38 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#define SLAB_SIZE (64 * 1024)  // Bytes carved into objects at a time
+#define SLAB_ALIGN 16          // Alignment of every object, the same as malloc's on x86-64
+
+// A pool of fixed-size objects. Objects are carved out of SLAB_SIZE slabs obtained from malloc
+// and freed objects are kept on a free list for reuse, so allocating an object only calls malloc
+// once per slab. Slabs are never returned to malloc.
+// Initialize a pool with SLAB_POOL(type).
+typedef struct slab_pool {
+    size_t obj_size;
+    void *free_list;   // Freed objects, linked through their first bytes
+    char *next;        // Next unused object in the current slab
+    char *end;         // End of the current slab
+} SlabPool;
+
+// Round the object size up so every object is suitably aligned and can hold the free list link.
+#define SLAB_OBJ_SIZE(size) \
+    ((((size) < sizeof(void *) ? sizeof(void *) : (size)) + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN)
+#define SLAB_POOL(type) {SLAB_OBJ_SIZE(sizeof(type)), NULL, NULL, NULL}
+
+
+/*
+ * Return a pointer to an uninitialized object from <pool>.
+ * Exits the program if no memory is available.
+ */
+void *slab_alloc(SlabPool *pool);
+
+
+/*
+ * Return the object <obj>, which must have come from slab_alloc on <pool>, to <pool>.
+ */
+void slab_free(SlabPool *pool, void *obj);
+
+#endif
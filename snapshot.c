@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "snapshot.h"
+
+#define SNAPSHOT_ALIGN 8  // Every section starts on a multiple of this
+#define SMAPS_ROLLUP "/proc/self/smaps_rollup"
+
+
+/*
+ * Return <offset> rounded up to the next section boundary.
+ */
+static uint64_t align_section(uint64_t offset) {
+    return (offset + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+}
+
+
+/*
+ * Write <len> bytes at <data> to <file>. Return 0 on success or -1 on failure.
+ */
+static int write_bytes(FILE *file, const void *data, size_t len) {
+    return fwrite(data, 1, len, file) == len ? 0 : -1;
+}
+
+
+/*
+ * Pad <file>, which is <offset> bytes long, to the section boundary <aligned>.
+ * Return 0 on success or -1 on failure.
+ */
+static int write_padding(FILE *file, uint64_t offset, uint64_t aligned) {
+    static const char zeros[SNAPSHOT_ALIGN] = {0};
+    return write_bytes(file, zeros, aligned - offset);
+}
+
+
+/*
+ * Write the sections of a snapshot of the list starting at <head>, described by <header>, to <file>.
+ * Return 0 on success or -1 on failure.
+ */
+static int write_sections(FILE *file, const SnapshotHeader *header, const User *head) {
+    if (write_bytes(file, header, sizeof(SnapshotHeader)) == -1) {
+        return -1;
+    }
+
+    uint64_t first_friend = 0;
+    uint64_t first_post = 0;
+    for (const User *user = head; user != NULL; user = user->next) {
+        SnapshotUser snap_user;
+        memset(&snap_user, 0, sizeof(snap_user));
+        strncpy(snap_user.name, user->name, MAX_NAME);
+        snap_user.first_friend = first_friend;
+        snap_user.num_friends = user->friends.count;
+        snap_user.first_post = first_post;
+        for (const Post *post = user->first_post; post != NULL; post = post->next) {
+            snap_user.num_posts++;
+        }
+        first_friend += snap_user.num_friends;
+        first_post += snap_user.num_posts;
+        if (write_bytes(file, &snap_user, sizeof(snap_user)) == -1) {
+            return -1;
+        }
+    }
+
+    if (write_padding(file, header->users_offset + header->num_users * sizeof(SnapshotUser),
+                      header->friends_offset) == -1) {
+        return -1;
+    }
+    for (const User *user = head; user != NULL; user = user->next) {
+        for (unsigned int i = 0; i < user->friends.count; i++) {
+            uint32_t id = user->friends.members[i]->id;
+            if (write_bytes(file, &id, sizeof(id)) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    if (write_padding(file, header->friends_offset + header->num_friend_ids * sizeof(uint32_t),
+                      header->posts_offset) == -1) {
+        return -1;
+    }
+    uint64_t contents = 0;
+    for (const User *user = head; user != NULL; user = user->next) {
+        for (const Post *post = user->first_post; post != NULL; post = post->next) {
+            SnapshotPost snap_post;
+            snap_post.author = find_user(post->author, head)->id;
+            snap_post.pad = 0;
+            snap_post.date = post->date;
+            snap_post.contents = contents;
+            contents += strlen(post->contents) + 1;
+            if (write_bytes(file, &snap_post, sizeof(snap_post)) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    for (const User *user = head; user != NULL; user = user->next) {
+        for (const Post *post = user->first_post; post != NULL; post = post->next) {
+            if (write_bytes(file, post->contents, strlen(post->contents) + 1) == -1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Write a snapshot of the list of users starting at <head> to <path>. The snapshot is written to
+ * a temporary file that replaces <path> once it is complete, so a crash never leaves a partial snapshot.
+ * <journal_offset> is the size of the journal at the moment the snapshot reflects.
+ * Return 0 on success or -1 if the snapshot could not be written.
+ */
+int save_snapshot(const char *path, const User *head, off_t journal_offset) {
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.journal_offset = journal_offset;
+
+    // Size every section first so the header can be written before them.
+    for (const User *user = head; user != NULL; user = user->next) {
+        header.num_users++;
+        header.num_friend_ids += user->friends.count;
+        for (const Post *post = user->first_post; post != NULL; post = post->next) {
+            header.num_posts++;
+            header.strings_size += strlen(post->contents) + 1;
+        }
+    }
+    header.users_offset = sizeof(SnapshotHeader);
+    header.friends_offset = align_section(header.users_offset + header.num_users * sizeof(SnapshotUser));
+    header.posts_offset = align_section(header.friends_offset + header.num_friend_ids * sizeof(uint32_t));
+    header.strings_offset = header.posts_offset + header.num_posts * sizeof(SnapshotPost);
+
+    char tmp_path[strlen(path) + sizeof(".tmp")];
+    sprintf(tmp_path, "%s.tmp", path);
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        perror("snapshot: fopen");
+        return -1;
+    }
+
+    if (write_sections(file, &header, head) == -1 || fflush(file) == EOF || fsync(fileno(file)) == -1) {
+        perror("snapshot: write");
+        fclose(file);
+        unlink(tmp_path);
+        return -1;
+    }
+    if (fclose(file) == EOF) {
+        perror("snapshot: fclose");
+        unlink(tmp_path);
+        return -1;
+    }
+    if (rename(tmp_path, path) == -1) {
+        perror("snapshot: rename");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Return 1 if the sections described by <header> fit in a file of <size> bytes and 0 otherwise.
+ */
+static int sections_fit(const SnapshotHeader *header, uint64_t size) {
+    return memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0
+           && header->num_users <= UINT32_MAX
+           && header->users_offset <= size
+           && header->num_users <= (size - header->users_offset) / sizeof(SnapshotUser)
+           && header->friends_offset <= size
+           && header->num_friend_ids <= (size - header->friends_offset) / sizeof(uint32_t)
+           && header->posts_offset <= size
+           && header->num_posts <= (size - header->posts_offset) / sizeof(SnapshotPost)
+           && header->strings_offset <= size
+           && header->strings_size == size - header->strings_offset;
+}
+
+
+/*
+ * Load the snapshot at <path> into the empty list of users whose head is pointed to by *user_ptr_add.
+ * The file stays mapped for as long as the program runs since loaded posts point into it.
+ * Set *journal_offset to the journal offset the snapshot reflects.
+ * Return the number of users loaded, 0 if there is no snapshot at <path>, or -1 if it could not be loaded.
+ */
+long load_snapshot(const char *path, User **user_ptr_add, off_t *journal_offset) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            *journal_offset = 0;
+            return 0;
+        }
+        perror("snapshot: open");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("snapshot: fstat");
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < sizeof(SnapshotHeader)) {
+        fprintf(stderr, "snapshot: %s is too short to be a snapshot\n", path);
+        close(fd);
+        return -1;
+    }
+
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("snapshot: mmap");
+        return -1;
+    }
+
+    const SnapshotHeader *header = (const SnapshotHeader *)map;
+    if (!sections_fit(header, st.st_size)
+        || (header->strings_size > 0 && map[st.st_size - 1] != '\0')) {
+        fprintf(stderr, "snapshot: %s is malformed\n", path);
+        munmap((void *)map, st.st_size);
+        return -1;
+    }
+    const SnapshotUser *snap_users = (const SnapshotUser *)&map[header->users_offset];
+    const uint32_t *friend_ids = (const uint32_t *)&map[header->friends_offset];
+    const SnapshotPost *snap_posts = (const SnapshotPost *)&map[header->posts_offset];
+    const char *strings = &map[header->strings_offset];
+
+    // The mapping is never unmapped once users start pointing into it, so from here on a bad
+    // snapshot is fatal rather than leaving a half loaded list behind.
+    User **users = malloc((header->num_users + 1) * sizeof(User *));
+    if (users == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (uint64_t i = 0; i < header->num_users; i++) {
+        const SnapshotUser *snap_user = &snap_users[i];
+        if (memchr(snap_user->name, '\0', MAX_NAME) == NULL
+            || create_user(snap_user->name, user_ptr_add) != 0) {
+            fprintf(stderr, "snapshot: %s has a bad or duplicate user\n", path);
+            exit(1);
+        }
+        users[i] = (*user_ptr_add)->table->tail;
+    }
+
+    for (uint64_t i = 0; i < header->num_users; i++) {
+        const SnapshotUser *snap_user = &snap_users[i];
+        if (snap_user->first_friend > header->num_friend_ids
+            || snap_user->num_friends > header->num_friend_ids - snap_user->first_friend
+            || snap_user->first_post > header->num_posts
+            || snap_user->num_posts > header->num_posts - snap_user->first_post) {
+            fprintf(stderr, "snapshot: %s has a bad user record\n", path);
+            exit(1);
+        }
+
+        // Each side of a friendship is stored with its own user, in the order it was made.
+        for (uint32_t j = 0; j < snap_user->num_friends; j++) {
+            uint32_t id = friend_ids[snap_user->first_friend + j];
+            if (id >= header->num_users) {
+                fprintf(stderr, "snapshot: %s has a bad friend id\n", path);
+                exit(1);
+            }
+            add_friend(&users[i]->friends, users[id]);
+        }
+
+        // Posts are stored newest first, so append each one after the last.
+        Post **post_ptr_add = &users[i]->first_post;
+        for (uint32_t j = 0; j < snap_user->num_posts; j++) {
+            const SnapshotPost *snap_post = &snap_posts[snap_user->first_post + j];
+            if (snap_post->author >= header->num_users || snap_post->contents >= header->strings_size) {
+                fprintf(stderr, "snapshot: %s has a bad post record\n", path);
+                exit(1);
+            }
+            Post *post = alloc_post();
+            strncpy(post->author, users[snap_post->author]->name, MAX_NAME);
+            post->contents = (char *)&strings[snap_post->contents];
+            post->date = snap_post->date;
+            post->next = NULL;
+            *post_ptr_add = post;
+            post_ptr_add = &post->next;
+        }
+        index_posts(users[i]);
+    }
+    free(users);
+
+    *journal_offset = header->journal_offset;
+    return header->num_users;
+}
+
+
+/*
+ * Return the current monotonic time in nanoseconds.
+ */
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/*
+ * Return the number of pages of this process that are no longer shared with its parent, from the
+ * Private_Dirty total of SMAPS_ROLLUP, or -1 if it cannot be read.
+ */
+static long count_private_pages() {
+    FILE *file = fopen(SMAPS_ROLLUP, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char line[128];
+    long kb = -1;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "Private_Dirty: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return kb == -1 ? -1 : kb * 1024 / sysconf(_SC_PAGESIZE);
+}
+
+
+/*
+ * Start writing a snapshot of the list of users starting at <head> to <path> in a forked child,
+ * as save_snapshot does. Wait for <save>->result_fd to become readable and then call
+ * finish_background_save. <save> must start zeroed with result_fd set to -1.
+ * Return 0 if the child was started, 1 if a save is already running, or -1 if fork failed.
+ */
+int start_background_save(BackgroundSave *save, const char *path, const User *head, off_t journal_offset) {
+    if (save->pid != 0) {
+        return 1;
+    }
+
+    int result_pipe[2];
+    if (pipe(result_pipe) == -1) {
+        perror("snapshot: pipe");
+        return -1;
+    }
+
+    long long start = now_ns();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("snapshot: fork");
+        close(result_pipe[0]);
+        close(result_pipe[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        // The child only writes the snapshot and its report. It leaves with _exit so it never
+        // flushes output the server buffered before the fork.
+        close(result_pipe[0]);
+        SaveReport report;
+        long long save_start = now_ns();
+        report.status = save_snapshot(path, head, journal_offset);
+        report.duration_ns = now_ns() - save_start;
+        report.cow_pages = count_private_pages();
+        // The report is smaller than PIPE_BUF, so it is written whole or not at all.
+        _exit(write(result_pipe[1], &report, sizeof(report)) == sizeof(report) ? 0 : 1);
+    }
+
+    save->fork_ns = now_ns() - start;
+    close(result_pipe[1]);
+    save->pid = pid;
+    save->result_fd = result_pipe[0];
+    return 0;
+}
+
+
+/*
+ * Collect the report of the child started by start_background_save into <save>->last and reap it.
+ * Return 0 if the snapshot was saved or -1 if it was not.
+ */
+int finish_background_save(BackgroundSave *save) {
+    SaveReport report;
+    ssize_t num_read;
+    while ((num_read = read(save->result_fd, &report, sizeof(report))) == -1 && errno == EINTR) {
+    }
+    if (num_read != sizeof(report)) {
+        // The child died without reporting.
+        report.status = -1;
+        report.duration_ns = 0;
+        report.cow_pages = -1;
+    }
+    close(save->result_fd);
+    while (waitpid(save->pid, NULL, 0) == -1 && errno == EINTR) {
+    }
+    save->pid = 0;
+    save->result_fd = -1;
+
+    save->last = report;
+    if (report.status == 0) {
+        save->num_saved++;
+    } else {
+        save->num_failed++;
+    }
+    return report.status;
+}
@@ -0,0 +1,103 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "friends.h"
+
+#define SNAPSHOT_MAGIC "FRSNAP1"
+
+// A snapshot is a compact binary image of every user, friendship and post, laid out so it can be
+// loaded straight out of an mmap of the file. It is made of a header followed by four sections,
+// each starting on an 8 byte boundary. Integers are in host byte order.
+//
+//   users:   num_users SnapshotUser, in list order (so a user's index is its id)
+//   friends: num_friend_ids uint32_t user ids; each user's friends are a contiguous run
+//   posts:   num_posts SnapshotPost; each user's posts are a contiguous run, newest first
+//   strings: the contents of every post, each followed by a null terminator
+//
+// Loaded posts point straight at their contents in the mapping, so contents are only read from
+// disk when a post is first rendered.
+typedef struct snapshot_header {
+    char magic[8];            // SNAPSHOT_MAGIC
+    uint64_t journal_offset;  // Journal records before this offset are reflected in the snapshot
+    uint64_t num_users;
+    uint64_t num_friend_ids;
+    uint64_t num_posts;
+    uint64_t strings_size;
+    uint64_t users_offset;
+    uint64_t friends_offset;
+    uint64_t posts_offset;
+    uint64_t strings_offset;
+} SnapshotHeader;
+
+typedef struct snapshot_user {
+    char name[MAX_NAME];
+    uint64_t first_friend;  // Index of the user's first friend in the friends section
+    uint64_t first_post;    // Index of the user's newest post in the posts section
+    uint32_t num_friends;
+    uint32_t num_posts;
+} SnapshotUser;
+
+typedef struct snapshot_post {
+    uint32_t author;     // Id of the author
+    uint32_t pad;
+    int64_t date;
+    uint64_t contents;   // Offset of the contents in the strings section
+} SnapshotPost;
+
+
+/*
+ * Write a snapshot of the list of users starting at <head> to <path>. The snapshot is written to
+ * a temporary file that replaces <path> once it is complete, so a crash never leaves a partial snapshot.
+ * <journal_offset> is the size of the journal at the moment the snapshot reflects.
+ * Return 0 on success or -1 if the snapshot could not be written.
+ */
+int save_snapshot(const char *path, const User *head, off_t journal_offset);
+
+
+/*
+ * Load the snapshot at <path> into the empty list of users whose head is pointed to by *user_ptr_add.
+ * The file stays mapped for as long as the program runs since loaded posts point into it.
+ * Set *journal_offset to the journal offset the snapshot reflects.
+ * Return the number of users loaded, 0 if there is no snapshot at <path>, or -1 if it could not be loaded.
+ */
+long load_snapshot(const char *path, User **user_ptr_add, off_t *journal_offset);
+
+
+// What a child writing a snapshot in the background reports when it finishes.
+typedef struct save_report {
+    int status;             // 0 if the snapshot was saved, -1 if it could not be written
+    long long duration_ns;  // Time the child spent writing the snapshot
+    long cow_pages;         // Pages no longer shared with the server when the child finished, -1 if unknown
+} SaveReport;
+
+// A snapshot written by a forked child so the server keeps serving while it is saved. The child
+// works on a copy-on-write image of the server's memory as it was at the fork, so every page the
+// server writes to while the child runs is copied; cow_pages reports how many were.
+typedef struct background_save {
+    pid_t pid;              // The child writing the snapshot, or 0 if none is running
+    int result_fd;          // Read end of the pipe the child reports on, -1 if none is running
+    long long fork_ns;      // Time the server was paused by the last fork
+    SaveReport last;        // Report of the last finished save
+    unsigned long num_saved;
+    unsigned long num_failed;
+} BackgroundSave;
+
+
+/*
+ * Start writing a snapshot of the list of users starting at <head> to <path> in a forked child,
+ * as save_snapshot does. Wait for <save>->result_fd to become readable and then call
+ * finish_background_save. <save> must start zeroed with result_fd set to -1.
+ * Return 0 if the child was started, 1 if a save is already running, or -1 if fork failed.
+ */
+int start_background_save(BackgroundSave *save, const char *path, const User *head, off_t journal_offset);
+
+
+/*
+ * Collect the report of the child started by start_background_save into <save>->last and reap it.
+ * Return 0 if the snapshot was saved or -1 if it was not.
+ */
+int finish_background_save(BackgroundSave *save);
+
+#endif
@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+
+/*
+ * Set up <ring> with room for <entries> submissions, a power of two.
+ * Return 0 on success or -1 with errno set if the kernel does not support io_uring.
+ */
+int uring_init(Uring *ring, unsigned entries) {
+    memset(ring, 0, sizeof(Uring));
+
+    // Multishot requests can complete many times each, so the completion queue is made larger.
+    // Cooperative task running saves an interrupt per completion; kernels older than 5.19 refuse
+    // the flag, so the ring is set up again without it.
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 8;
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd == -1 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 8;
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (fd == -1) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_SQ_RING);
+    if (ring->rings == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->rings, ring->rings_size);
+        close(fd);
+        return -1;
+    }
+
+    char *rings = ring->rings;
+    ring->fd = fd;
+    ring->features = params.features;
+    ring->sq_head = (unsigned *)(rings + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(rings + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(rings + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(rings + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(rings + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    // Entry i of the submission queue always uses submission queue entry i.
+    unsigned *array = (unsigned *)(rings + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    return 0;
+}
+
+
+/*
+ * Unmap and close <ring> and its provided buffers.
+ */
+static void uring_free(Uring *ring) {
+    if (ring->buf_ring != NULL) {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+        free(ring->buffers);
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->rings, ring->rings_size);
+    close(ring->fd);
+}
+
+
+/*
+ * Return 0 if this kernel supports every io_uring feature friend_server uses and -1 otherwise.
+ */
+int uring_supported() {
+    Uring ring;
+    if (uring_init(&ring, 8) == -1) {
+        return -1;
+    }
+
+    // Waiting with a timeout needs the extended enter argument, and provided buffer rings need
+    // their own registration. Multishot accept came with provided buffer rings (5.19) and multishot
+    // receive with zero copy send (6.0), so that opcode stands in for it.
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    if (probe == NULL) {
+        perror("io_uring probe calloc");
+        exit(1);
+    }
+    int supported = (ring.features & IORING_FEAT_EXT_ARG)
+            && syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0
+            && probe->last_op >= IORING_OP_SEND_ZC
+            && (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED)
+            && uring_setup_buffers(&ring, 0, 1, 64) == 0;
+    free(probe);
+    uring_free(&ring);
+    return supported ? 0 : -1;
+}
+
+
+/*
+ * Register <count> (a power of two) buffers of <size> bytes each as provided buffer group <group>.
+ * Return 0 on success or -1 with errno set.
+ */
+int uring_setup_buffers(Uring *ring, unsigned short group, unsigned count, unsigned size) {
+    // The kernel wants the ring of buffer descriptors page aligned, which mmap guarantees.
+    ring->buf_ring_size = count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring->buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+        ring->buf_ring = NULL;
+        return -1;
+    }
+
+    ring->buffers = malloc((size_t)count * size);
+    if (ring->buffers == NULL) {
+        perror("io_uring buffers malloc");
+        exit(1);
+    }
+    ring->buf_count = count;
+    ring->buf_size = size;
+    ring->buf_group = group;
+    for (unsigned id = 0; id < count; id++) {
+        uring_recycle_buffer(ring, id);
+    }
+    return 0;
+}
+
+
+/*
+ * Return the provided buffer with id <id>.
+ */
+char *uring_buffer(Uring *ring, unsigned id) {
+    return &ring->buffers[(size_t)id * ring->buf_size];
+}
+
+
+/*
+ * Give the provided buffer with id <id> back to the kernel once its data has been used.
+ */
+void uring_recycle_buffer(Uring *ring, unsigned id) {
+    // Only this thread writes the tail, so it can be read without ordering.
+    unsigned short tail = ring->buf_ring->tail;
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[tail & (ring->buf_count - 1)];
+    buf->addr = (unsigned long)uring_buffer(ring, id);
+    buf->len = ring->buf_size;
+    buf->bid = id;
+    // The kernel may use the buffer as soon as it sees the new tail.
+    __atomic_store_n(&ring->buf_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Make the prepared entries visible to the kernel and enter it to submit them, waiting for
+ * <wait_nr> completions if <wait_nr> is not 0. <arg> is the extended argument holding the timeout, or NULL.
+ * Return the result of io_uring_enter.
+ */
+static int enter(Uring *ring, unsigned wait_nr, struct io_uring_getevents_arg *arg) {
+    unsigned to_submit = ring->sqe_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (arg != NULL) {
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    ring->num_enters++;
+    return syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, flags, arg,
+                   arg != NULL ? sizeof(*arg) : _NSIG / 8);
+}
+
+
+/*
+ * Return a zeroed submission queue entry to prepare a request in. If the queue is full, the
+ * entries already prepared are submitted first.
+ */
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    while (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (enter(ring, 0, NULL) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqe_tail++;
+    return sqe;
+}
+
+
+/*
+ * Submit every prepared entry and wait until at least <wait_nr> completions are ready or
+ * <timeout_ms> milliseconds pass (-1 to wait as long as it takes).
+ * Return 0 on success (including a timeout or an interruption) or -1 with errno set.
+ */
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr, int timeout_ms) {
+    // Completions that are already ready are not waited for.
+    if (uring_peek_cqe(ring) != NULL) {
+        wait_nr = 0;
+    }
+    if (wait_nr == 0 && ring->sqe_tail == *ring->sq_tail) {
+        return 0;
+    }
+
+    struct __kernel_timespec timeout;
+    struct io_uring_getevents_arg arg;
+    struct io_uring_getevents_arg *arg_ptr = NULL;
+    if (wait_nr > 0 && timeout_ms >= 0) {
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (unsigned long)&timeout;
+        arg_ptr = &arg;
+    }
+    if (enter(ring, wait_nr, arg_ptr) == -1 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Return the oldest completion that has not been seen yet or NULL if there is none.
+ */
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+
+/*
+ * Mark the completion returned by uring_peek_cqe as seen so its slot can be reused.
+ */
+void uring_cqe_seen(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
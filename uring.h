@@ -0,0 +1,100 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+// A minimal io_uring over the raw system calls, so friend_server does not need liburing.
+// Requests are prepared in submission queue entries from uring_get_sqe and are only submitted
+// by uring_submit_and_wait, so everything prepared during an event loop pass goes to the
+// kernel in one system call. Completions are read from the completion queue without a system call.
+//
+// A ring can also have a provided buffer ring: a group of equal sized buffers the kernel picks
+// from as data arrives (IOSQE_BUFFER_SELECT), so a receive only takes a buffer once it has data.
+typedef struct uring {
+    int fd;
+    void *rings;            // The submission and completion queues, mapped in one piece
+    size_t rings_size;
+    size_t sqes_size;
+    unsigned features;      // IORING_FEAT_* flags of this kernel
+    // Submission queue, shared with the kernel.
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;      // Entries before this have been prepared; *sq_tail is updated on submit
+    // Completion queue, shared with the kernel.
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // Provided buffers.
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    unsigned buf_count;     // A power of two
+    unsigned buf_size;
+    unsigned short buf_group;
+    size_t buf_ring_size;
+    unsigned long num_enters;  // Number of io_uring_enter system calls made
+} Uring;
+
+
+/*
+ * Set up <ring> with room for <entries> submissions, a power of two.
+ * Return 0 on success or -1 with errno set if the kernel does not support io_uring.
+ */
+int uring_init(Uring *ring, unsigned entries);
+
+
+/*
+ * Return 0 if this kernel supports every io_uring feature friend_server uses and -1 otherwise.
+ */
+int uring_supported();
+
+
+/*
+ * Register <count> (a power of two) buffers of <size> bytes each as provided buffer group <group>.
+ * Return 0 on success or -1 with errno set.
+ */
+int uring_setup_buffers(Uring *ring, unsigned short group, unsigned count, unsigned size);
+
+
+/*
+ * Return the provided buffer with id <id>.
+ */
+char *uring_buffer(Uring *ring, unsigned id);
+
+
+/*
+ * Give the provided buffer with id <id> back to the kernel once its data has been used.
+ */
+void uring_recycle_buffer(Uring *ring, unsigned id);
+
+
+/*
+ * Return a zeroed submission queue entry to prepare a request in. If the queue is full, the
+ * entries already prepared are submitted first.
+ */
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+
+
+/*
+ * Submit every prepared entry and wait until at least <wait_nr> completions are ready or
+ * <timeout_ms> milliseconds pass (-1 to wait as long as it takes).
+ * Return 0 on success (including a timeout or an interruption) or -1 with errno set.
+ */
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr, int timeout_ms);
+
+
+/*
+ * Return the oldest completion that has not been seen yet or NULL if there is none.
+ */
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+
+
+/*
+ * Mark the completion returned by uring_peek_cqe as seen so its slot can be reused.
+ */
+void uring_cqe_seen(Uring *ring);
+
+#endif